@@ -19,18 +19,22 @@ limitations under the License.
 #include <float.h>
 #include <math.h>
 
-#include "gflags/gflags.h"
-#include "glog/logging.h"
-#include "tree.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include <utility>
 
-DEFINE_string(loss_type, "",
-              "Loss type. Required: One of exponential, logistic.");
+#include "glog/logging.h"
+#include "parallel.h"
+#include "scorer.h"
 
-float ComputeEta(float wgtd_error, float tree_size, float alpha) {
+float ComputeEta(const TreeContext& context, float wgtd_error, float tree_size,
+                 float alpha) {
   wgtd_error = fmax(wgtd_error, kTolerance);  // Helps with division by zero.
   const float error_term =
       (1 - wgtd_error) * exp(alpha) - wgtd_error * exp(-alpha);
-  const float complexity_penalty = ComplexityPenalty(tree_size);
+  const float complexity_penalty = ComplexityPenalty(context, tree_size);
   const float ratio = complexity_penalty / wgtd_error;
   float eta;
   if (fabs(error_term) <= 2 * complexity_penalty) {
@@ -43,55 +47,245 @@ float ComputeEta(float wgtd_error, float tree_size, float alpha) {
   return eta;
 }
 
-// TODO(usyed): examples is passed by non-const reference because the example
-// weights need to be changed. This is bad style.
-void AddTreeToModel(vector<Example>& examples, Model* model) {
-  // Initialize normalizer
-  static float normalizer;
+// Number of partial sums kept by the weight updates below, one per lane of an
+// AVX2 register. With and without AVX2, the same values are added in the same
+// order, so the updated weights are the same.
+static const int kNumLanes = 8;
+
+// Return the sum of the partial sums.
+static float SumLanes(const float* sums) {
+  float sum = 0;
+  for (int j = 0; j < kNumLanes; ++j) {
+    sum += sums[j];
+  }
+  return sum;
+}
+
+// Multiply the weight of each example by factors[1] if mistakes, as returned
+// by MakeMistakes(), says the example is misclassified, and by factors[0]
+// otherwise, and return the sum of the new weights.
+static float ScaleAndSumWeights(const vector<uint64_t>& mistakes,
+                                const float factors[2],
+                                vector<Weight>* weights) {
+  const int num_examples = weights->size();
+  Weight* w = weights->data();
+  float sums[kNumLanes] = {0};
+  int i = 0;
+#ifdef __AVX2__
+  const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m256 right_factor = _mm256_set1_ps(factors[0]);
+  const __m256 wrong_factor = _mm256_set1_ps(factors[1]);
+  __m256 sum = _mm256_setzero_ps();
+  for (; i + kNumLanes <= num_examples; i += kNumLanes) {
+    // The mistake bits of the eight examples, one per lane.
+    const __m256i bits =
+        _mm256_set1_epi32((mistakes[i / 64] >> (i % 64)) & 0xff);
+    const __m256i wrong = _mm256_cmpeq_epi32(
+        _mm256_and_si256(bits, lane_bits), lane_bits);
+    const __m256 factor = _mm256_blendv_ps(right_factor, wrong_factor,
+                                           _mm256_castsi256_ps(wrong));
+    const __m256 new_w = _mm256_mul_ps(_mm256_loadu_ps(w + i), factor);
+    _mm256_storeu_ps(w + i, new_w);
+    sum = _mm256_add_ps(sum, new_w);
+  }
+  _mm256_storeu_ps(sums, sum);
+#endif
+  for (; i < num_examples; ++i) {
+    w[i] *= factors[(mistakes[i / 64] >> (i % 64)) & 1];
+    sums[i % kNumLanes] += w[i];
+  }
+  return SumLanes(sums);
+}
+
+// Set the weight of each example to its logistic loss weight after eta is
+// added to the weight of the tree with mistakes, given the normalizer of the
+// current weights times their weight scale, and return the sum of the new
+// weights. The new weights are not normalized.
+static float UpdateLogisticWeights(const vector<uint64_t>& mistakes, float eta,
+                                   float old_normalizer,
+                                   vector<Weight>* weights) {
+  const float log_2 = log(2);
+  // exp(u), where u is eta times the product of the label and the tree's
+  // prediction, for correctly and incorrectly classified examples.
+  const float exp_u[2] = {exp(eta), exp(-eta)};
+  const int num_examples = weights->size();
+  Weight* w = weights->data();
+  float sums[kNumLanes] = {0};
+  int i = 0;
+#ifdef __AVX2__
+  const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m256 right_exp_u = _mm256_set1_ps(exp_u[0]);
+  const __m256 wrong_exp_u = _mm256_set1_ps(exp_u[1]);
+  const __m256 log_2s = _mm256_set1_ps(log_2);
+  const __m256 old_normalizers = _mm256_set1_ps(old_normalizer);
+  const __m256 ones = _mm256_set1_ps(1);
+  __m256 sum = _mm256_setzero_ps();
+  for (; i + kNumLanes <= num_examples; i += kNumLanes) {
+    const __m256i bits =
+        _mm256_set1_epi32((mistakes[i / 64] >> (i % 64)) & 0xff);
+    const __m256i wrong = _mm256_cmpeq_epi32(
+        _mm256_and_si256(bits, lane_bits), lane_bits);
+    const __m256 e = _mm256_blendv_ps(right_exp_u, wrong_exp_u,
+                                      _mm256_castsi256_ps(wrong));
+    const __m256 a = _mm256_mul_ps(
+        _mm256_mul_ps(log_2s, _mm256_loadu_ps(w + i)), old_normalizers);
+    const __m256 z = _mm256_div_ps(_mm256_sub_ps(ones, a), a);
+    const __m256 new_w = _mm256_div_ps(
+        ones, _mm256_mul_ps(log_2s, _mm256_add_ps(ones, _mm256_mul_ps(z, e))));
+    _mm256_storeu_ps(w + i, new_w);
+    sum = _mm256_add_ps(sum, new_w);
+  }
+  _mm256_storeu_ps(sums, sum);
+#endif
+  for (; i < num_examples; ++i) {
+    const float a = log_2 * w[i] * old_normalizer;
+    const float z = (1 - a) / a;
+    w[i] = 1 / (log_2 * (1 + z * exp_u[(mistakes[i / 64] >> (i % 64)) & 1]));
+    sums[i % kNumLanes] += w[i];
+  }
+  return SumLanes(sums);
+}
+
+namespace {
+
+// The losses that a model can be trained with. A loss gives the normalizer
+// of the example weights before the first tree is added to a model, and
+// updates the weights after a tree is added or reweighted.
+// Trainer::AddTreeToModel() is instantiated once per loss, so that the weight
+// update is inlined.
+
+// Exponential loss, exp(-margin).
+struct ExponentialLoss {
+  static float InitialNormalizer(int num_examples) {
+    return exp(1) * static_cast<float>(num_examples);
+  }
+
+  // Update weights, whose current scale is weight_scale, after eta is added to
+  // the weight of the tree with mistakes. Set normalizer to the sum of the
+  // updated weights, and weight_scale to its inverse, so that the weights are
+  // renormalized by the next update instead of by a pass of their own. Every
+  // weight is scaled by one of two factors, so exp() is only called twice.
+  static void UpdateWeights(const vector<uint64_t>& mistakes, float eta,
+                            float* normalizer, float* weight_scale,
+                            vector<Weight>* weights) {
+    const float factors[2] = {exp(-eta) * *weight_scale,
+                              exp(eta) * *weight_scale};
+    *normalizer = ScaleAndSumWeights(mistakes, factors, weights);
+    *weight_scale = 1 / *normalizer;
+  }
+};
+
+// Logistic loss, log2(1 + exp(-margin)).
+struct LogisticLoss {
+  static float InitialNormalizer(int num_examples) {
+    return static_cast<float>(num_examples) / (log(2) * (1 + exp(-1)));
+  }
+
+  // Same as ExponentialLoss::UpdateWeights().
+  static void UpdateWeights(const vector<uint64_t>& mistakes, float eta,
+                            float* normalizer, float* weight_scale,
+                            vector<Weight>* weights) {
+    *normalizer = UpdateLogisticWeights(
+        mistakes, eta, *normalizer * *weight_scale, weights);
+    *weight_scale = 1 / *normalizer;
+  }
+};
+
+}  // namespace
+
+Trainer::Trainer(const ModelParams& params, const ExampleSet* examples,
+                 const FeatureIndex* index)
+    : examples_(examples), weights_(examples->weights) {
+  if (params.loss_type == "exponential") {
+    add_tree_ = &Trainer::AddTreeToModelWithLoss<ExponentialLoss>;
+  } else if (params.loss_type == "logistic") {
+    add_tree_ = &Trainer::AddTreeToModelWithLoss<LogisticLoss>;
+  } else {
+    LOG(FATAL) << "Unexpected loss type: " << params.loss_type;
+  }
+  context_.beta = params.beta;
+  context_.lambda = params.lambda;
+  context_.tree_depth = params.tree_depth;
+  InitializeTreeContext(*examples, *index, weights_, &context_);
+}
+
+vector<Weight> Trainer::weights() const {
+  vector<Weight> weights = weights_;
+  for (Weight& weight : weights) {
+    weight *= context_.weight_scale;
+  }
+  return weights;
+}
+
+void Trainer::AddTreeToModel(Model* model) {
+  // The loss is chosen when the trainer is made, so the weight update is not
+  // dispatched on the loss for every example.
+  (this->*add_tree_)(model);
+}
+
+template <typename Loss>
+void Trainer::AddTreeToModelWithLoss(Model* model) {
   if (model->empty()) {
-    if (FLAGS_loss_type == "exponential") {
-      normalizer = exp(1) * static_cast<float>(examples.size());
-    } else if (FLAGS_loss_type == "logistic") {
-      normalizer =
-          static_cast<float>(examples.size()) / (log(2) * (1 + exp(-1)));
-    } else {
-      LOG(FATAL) << "Unexpected loss type: " << FLAGS_loss_type;
-    }
+    model_mistakes_.clear();
+    weights_ = examples_->weights;
+    context_.weight_scale = 1;
+    context_.normalizer = Loss::InitialNormalizer(examples_->num_examples);
   }
-  InitializeTreeData(examples, normalizer);
+  CHECK_EQ(model_mistakes_.size(), model->size());
   int best_old_tree_idx = -1;
-  float best_wgtd_error, wgtd_error, gradient, best_gradient = 0;
+  float best_wgtd_error = 0, best_gradient = 0;
 
-  // Find best old tree
-  bool old_tree_is_best = false;
-  for (int i = 0; i < model->size(); ++i) {
+  // Evaluate old trees. Each old tree is evaluated on its own, so the trees
+  // are evaluated by the thread pool in the background while the new tree is
+  // trained, since both only read the example weights.
+  const int model_size = model->size();
+  vector<float> old_tree_wgtd_errors(model_size);
+  vector<float> old_tree_gradients(model_size);
+  BackgroundParallelFor evaluate_old_trees(model_size, [&](int i) {
     const float alpha = (*model)[i].first;
-    if (fabs(alpha) < kTolerance) continue;  // Skip zeroed-out weights.
-    const Tree& old_tree = (*model)[i].second;
-    wgtd_error = EvaluateTreeWgtd(examples, old_tree);
-    int sign_edge = (wgtd_error >= 0.5) ? 1 : -1;
-    gradient = Gradient(wgtd_error, old_tree.size(), alpha, sign_edge);
-    if (fabs(gradient) >= fabs(best_gradient)) {
-      best_gradient = gradient;
-      best_wgtd_error = wgtd_error;
+    if (fabs(alpha) < kTolerance) return;  // Skip zeroed-out weights.
+    const FrozenTree& old_tree = (*model)[i].second;
+    const float wgtd_error = EvaluateMistakesWgtd(context_, model_mistakes_[i]);
+    const int sign_edge = (wgtd_error >= 0.5) ? 1 : -1;
+    old_tree_wgtd_errors[i] = wgtd_error;
+    old_tree_gradients[i] =
+        Gradient(context_, wgtd_error, old_tree.size(), alpha, sign_edge);
+  });
+
+  // Find best new tree
+  FrozenTree new_tree = FreezeTree(TrainTree(context_, *examples_));
+  vector<uint64_t> new_tree_mistakes =
+      MakeMistakes(context_, *examples_, new_tree);
+  const float new_tree_wgtd_error =
+      EvaluateMistakesWgtd(context_, new_tree_mistakes);
+  const float new_tree_gradient =
+      Gradient(context_, new_tree_wgtd_error, new_tree.size(), 0, -1);
+  evaluate_old_trees.Wait();
+
+  // Find best old tree, in model order, so that ties go to the last one.
+  bool old_tree_is_best = false;
+  for (int i = 0; i < model_size; ++i) {
+    if (fabs((*model)[i].first) < kTolerance) continue;
+    if (fabs(old_tree_gradients[i]) >= fabs(best_gradient)) {
+      best_gradient = old_tree_gradients[i];
+      best_wgtd_error = old_tree_wgtd_errors[i];
       best_old_tree_idx = i;
       old_tree_is_best = true;
     }
   }
 
-  // Find best new tree
-  Tree new_tree = TrainTree(examples);
-  wgtd_error = EvaluateTreeWgtd(examples, new_tree);
-  gradient = Gradient(wgtd_error, new_tree.size(), 0, -1);
-  if (model->empty() || fabs(gradient) > fabs(best_gradient)) {
-    best_gradient = gradient;
-    best_wgtd_error = wgtd_error;
+  // Compare with best new tree. If every old tree has zero weight (or there
+  // are none), the new tree is added even if its gradient is zero, so that
+  // its own weighted error is used to compute its weight.
+  if (!old_tree_is_best || fabs(new_tree_gradient) > fabs(best_gradient)) {
+    best_gradient = new_tree_gradient;
+    best_wgtd_error = new_tree_wgtd_error;
     old_tree_is_best = false;
   }
 
   // Update model weights
   float alpha;
-  const Tree* tree;
+  const FrozenTree* tree;
   if (old_tree_is_best) {
     alpha = (*model)[best_old_tree_idx].first;
     tree = &((*model)[best_old_tree_idx].second);
@@ -99,40 +293,25 @@ void AddTreeToModel(vector<Example>& examples, Model* model) {
     alpha = 0;
     tree = &(new_tree);
   }
-  const float eta = ComputeEta(best_wgtd_error, tree->size(), alpha);
+  const float eta = ComputeEta(context_, best_wgtd_error, tree->size(), alpha);
+  const vector<uint64_t>* mistakes;
   if (old_tree_is_best) {
     (*model)[best_old_tree_idx].first += eta;
+    mistakes = &model_mistakes_[best_old_tree_idx];
   } else {
     model->push_back(make_pair(eta, new_tree));
+    model_mistakes_.push_back(std::move(new_tree_mistakes));
+    mistakes = &model_mistakes_.back();
   }
 
   // Update examples weights and compute normalizer
-  const float old_normalizer = normalizer;
-  normalizer = 0;
-  for (Example& example : examples) {
-    const float u = eta * example.label * ClassifyExample(example, *tree);
-    if (FLAGS_loss_type == "exponential") {
-      example.weight *= exp(-u);
-    } else if (FLAGS_loss_type == "logistic") {
-      const float z = (1 - log(2) * example.weight * old_normalizer) /
-                      (log(2) * example.weight * old_normalizer);
-      example.weight = 1 / (log(2) * (1 + z * exp(u)));
-    } else {
-      LOG(FATAL) << "Unexpected loss type: " << FLAGS_loss_type;
-    }
-    normalizer += example.weight;
-  }
-
-  // Renormalize example weights
-  // TODO(usyed): Two loops is inefficient.
-  for (Example& example : examples) {
-    example.weight /= normalizer;
-  }
+  Loss::UpdateWeights(*mistakes, eta, &context_.normalizer,
+                      &context_.weight_scale, &weights_);
 }
 
 Label ClassifyExample(const Example& example, const Model& model) {
   float score = 0;
-  for (const pair<Weight, Tree>& wgtd_tree : model) {
+  for (const pair<Weight, FrozenTree>& wgtd_tree : model) {
     score += wgtd_tree.first * ClassifyExample(example, wgtd_tree.second);
   }
   if (score < 0) {
@@ -142,22 +321,61 @@ Label ClassifyExample(const Example& example, const Model& model) {
   }
 }
 
-void EvaluateModel(const vector<Example>& examples, const Model& model,
-                   float* error, float* avg_tree_size, int* num_trees) {
-  float incorrect = 0;
-  for (const Example& example : examples) {
-    if (example.label != ClassifyExample(example, model)) {
-      ++incorrect;
-    }
-  }
+// Compute the number of trees in model with non-zero weight and their average
+// size.
+static void EvaluateModelSize(const Model& model, float* avg_tree_size,
+                              int* num_trees) {
   *num_trees = 0;
   int sum_tree_size = 0;
-  for (const pair<Weight, Tree>& wgtd_tree : model) {
+  for (const pair<Weight, FrozenTree>& wgtd_tree : model) {
     if (fabs(wgtd_tree.first) >= kTolerance) {
       ++(*num_trees);
       sum_tree_size += wgtd_tree.second.size();
     }
   }
-  *error = (incorrect / examples.size());
   *avg_tree_size = static_cast<float>(sum_tree_size) / *num_trees;
 }
+
+void EvaluateModel(const ExampleSet& examples, const Model& model,
+                   float* error, float* avg_tree_size, int* num_trees) {
+  vector<float> scores;
+  ScoreExamples(examples, CompileModel(model), &scores);
+  float incorrect = 0;
+  for (int i = 0; i < examples.num_examples; ++i) {
+    const Label label = (scores[i] < 0) ? -1 : 1;
+    if (examples.labels[i] != label) {
+      ++incorrect;
+    }
+  }
+  *error = (incorrect / examples.num_examples);
+  EvaluateModelSize(model, avg_tree_size, num_trees);
+}
+
+ModelEvaluator::ModelEvaluator(const ExampleSet* examples)
+    : examples_(examples), margins_(examples->num_examples, 0) {}
+
+void ModelEvaluator::Evaluate(const Model& model, float* error,
+                              float* avg_tree_size, int* num_trees) {
+  CHECK_GE(model.size(), tree_weights_.size());
+  tree_weights_.resize(model.size(), 0);
+  vector<float> scores;
+  for (size_t i = 0; i < model.size(); ++i) {
+    const Weight delta_weight = model[i].first - tree_weights_[i];
+    if (delta_weight == 0) continue;
+    const Model delta_model(1, make_pair(delta_weight, model[i].second));
+    ScoreExamples(*examples_, CompileModel(delta_model), &scores);
+    for (int j = 0; j < examples_->num_examples; ++j) {
+      margins_[j] += scores[j];
+    }
+    tree_weights_[i] = model[i].first;
+  }
+  float incorrect = 0;
+  for (int j = 0; j < examples_->num_examples; ++j) {
+    const Label label = (margins_[j] < 0) ? -1 : 1;
+    if (examples_->labels[j] != label) {
+      ++incorrect;
+    }
+  }
+  *error = (incorrect / examples_->num_examples);
+  EvaluateModelSize(model, avg_tree_size, num_trees);
+}
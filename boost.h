@@ -17,24 +17,103 @@ limitations under the License.
 #ifndef BOOST_H_
 #define BOOST_H_
 
+#include <stdint.h>
+
+#include <string>
+
+#include "tree.h"
 #include "types.h"
 
-// Either add a new tree to model or update the weight of an existing tree in
-// model. The tree and weight are selected via approximate coordinate descent on
-// the objective, where the "approximate" indicates that we do not search all
-// trees but instead grow trees greedily.
-void AddTreeToModel(vector<Example>& examples, Model* model);
+using std::string;
+
+// Hyperparameters of a model.
+typedef struct ModelParams {
+  string loss_type;  // One of exponential, logistic.
+  double beta;  // beta parameter for gradient.
+  double lambda;  // lambda parameter for gradient.
+  int tree_depth;  // Maximum depth of each tree. Required: tree_depth >= 0.
+} ModelParams;
+
+// Trains a model on a set of examples. A trainer owns all the state of the
+// model being trained, such as the current example weights, so several
+// trainers can train models at the same time, e.g. on separate threads, on the
+// same examples and feature index.
+class Trainer {
+ public:
+  // examples and index, the feature index of examples, must outlive the
+  // trainer.
+  Trainer(const ModelParams& params, const ExampleSet* examples,
+          const FeatureIndex* index);
+
+  // The context of a trainer points to its own weights, so a trainer cannot be
+  // copied or moved.
+  Trainer(const Trainer&) = delete;
+  Trainer& operator=(const Trainer&) = delete;
+
+  // Either add a new tree to model or update the weight of an existing tree in
+  // model. The tree and weight are selected via approximate coordinate descent
+  // on the objective, where the "approximate" indicates that we do not search
+  // all trees but instead grow trees greedily. The example weights are
+  // updated. If model is empty, training restarts from the initial weights of
+  // the examples. Between calls, model must not be modified otherwise. The
+  // trees in model are evaluated in the background while the new tree is
+  // trained, and the result does not depend on the number of threads.
+  void AddTreeToModel(Model* model);
+
+  // Current weight of each example. The trainer keeps the weights
+  // unnormalized, so this returns a normalized copy.
+  vector<Weight> weights() const;
+
+  // Context the trees of the model are trained with.
+  const TreeContext& context() const { return context_; }
+
+ private:
+  // Same as AddTreeToModel(), for the loss Loss.
+  template <typename Loss>
+  void AddTreeToModelWithLoss(Model* model);
+
+  const ExampleSet* examples_;
+  // Version of AddTreeToModel() for the loss of the model.
+  void (Trainer::*add_tree_)(Model* model);
+  vector<Weight> weights_;
+  TreeContext context_;
+  // Mistakes of each tree in the model on the examples. These never change, so
+  // they are computed once, when the tree is added to the model.
+  vector<vector<uint64_t>> model_mistakes_;
+};
 
 // Classify example with model.
 Label ClassifyExample(const Example& example, const Model& model);
 
 // Compute the error of model on examples. Also compute the number of trees in
 // model and their average size.
-void EvaluateModel(const vector<Example>& examples, const Model& model,
+void EvaluateModel(const ExampleSet& examples, const Model& model,
                    float* error, float* avg_tree_size, int* num_trees);
 
+// Evaluates a model on a fixed set of examples while the model is being
+// trained. The margin of the model on each example is kept between calls, and
+// each call only applies the trees that were added or reweighted since the
+// previous call, instead of classifying the examples with the whole model.
+class ModelEvaluator {
+ public:
+  explicit ModelEvaluator(const ExampleSet* examples);
+
+  // Compute the same quantities as EvaluateModel(). Between calls, trees may
+  // only be added to the end of model or have their weights changed.
+  void Evaluate(const Model& model, float* error, float* avg_tree_size,
+                int* num_trees);
+
+ private:
+  const ExampleSet* examples_;
+  // Margin of the model on each example of the set, as of the previous call.
+  vector<float> margins_;
+  // Weight of each tree in the model, as of the previous call.
+  vector<Weight> tree_weights_;
+};
+
 // Return the optimal weight to add to a tree that will maximally decrease the
-// objective.
-float ComputeEta(float wgtd_error, float tree_size, float alpha);
+// objective of the model trained with context.
+float ComputeEta(const TreeContext& context, float wgtd_error, float tree_size,
+                 float alpha);
 
 #endif  // BOOST_H_
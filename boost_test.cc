@@ -16,6 +16,8 @@ limitations under the License.
 
 #include <math.h>
 
+#include <thread>
+
 #include "boost.h"
 #include "tree.h"  // TODO(usyed): Figure out how not to have to include this.
 #include "srm_test.h"
@@ -23,28 +25,29 @@ limitations under the License.
 #include "gflags/gflags.h"
 #include "gtest/gtest.h"
 
-DECLARE_int32(tree_depth);
-DECLARE_double(beta);
-DECLARE_double(lambda);
-DECLARE_string(loss_type);
+DECLARE_int32(num_threads);
 
 class BoostTest : public SrmTest {
  protected:
   virtual void SetUp() {
     SrmTest::SetUp();
-    InitializeTreeData(examples_, examples_.size());
+    feature_index_ = MakeFeatureIndex(example_set_);
+    params_.loss_type = "exponential";
+    params_.beta = 0;
+    params_.lambda = 0;
+    params_.tree_depth = 1;
   }
+
+  FeatureIndex feature_index_;  // Feature index of example_set_.
+  ModelParams params_;
 };
 
 TEST_F(BoostTest, TestAddTreeToModel) {
-  FLAGS_tree_depth = 1;
-  FLAGS_beta = 0;
-  FLAGS_lambda = 0;
-  FLAGS_loss_type = "exponential";
+  Trainer trainer(params_, &example_set_, &feature_index_);
   Model model;
   // Train a model with a single tree. The tree's weighted error will be 0.2,
   // and it will only get example 3 wrong.
-  AddTreeToModel(examples_, &model);
+  trainer.AddTreeToModel(&model);
   // Every example is originally weighted equally.
   const float original_wgt = 0.2;
   // alpha = 0.5 * log((1 - error) / error), where error = 0.2.
@@ -54,15 +57,15 @@ TEST_F(BoostTest, TestAddTreeToModel) {
   // Adjust weights and normalize.
   float correct_wgt = original_wgt * exp(-alpha) / normalizer;
   float incorrect_wgt = original_wgt * exp(alpha) / normalizer;
-  EXPECT_NEAR(correct_wgt, examples_[0].weight, kTolerance);
-  EXPECT_NEAR(correct_wgt, examples_[1].weight, kTolerance);
-  EXPECT_NEAR(correct_wgt, examples_[2].weight, kTolerance);
-  EXPECT_NEAR(incorrect_wgt, examples_[3].weight, kTolerance);
-  EXPECT_NEAR(correct_wgt, examples_[4].weight, kTolerance);
+  EXPECT_NEAR(correct_wgt, trainer.weights()[0], kTolerance);
+  EXPECT_NEAR(correct_wgt, trainer.weights()[1], kTolerance);
+  EXPECT_NEAR(correct_wgt, trainer.weights()[2], kTolerance);
+  EXPECT_NEAR(incorrect_wgt, trainer.weights()[3], kTolerance);
+  EXPECT_NEAR(correct_wgt, trainer.weights()[4], kTolerance);
 
   // Add another tree to the model. The tree's weighted error will be 0.125, and
   // it will only get example 4 wrong.
-  AddTreeToModel(examples_, &model);
+  trainer.AddTreeToModel(&model);
   // alpha = 0.5 * log((1 - error) / error), where error = 0.125.
   alpha = 0.97295507452;
   // Normalizer is sum of all adjusted weights.
@@ -71,21 +74,18 @@ TEST_F(BoostTest, TestAddTreeToModel) {
   float both_correct_wgt = correct_wgt * exp(-alpha) / normalizer;
   float first_correct_wgt = correct_wgt * exp(alpha) / normalizer;
   float second_correct_wgt = incorrect_wgt * exp(-alpha) / normalizer;
-  EXPECT_NEAR(both_correct_wgt, examples_[0].weight, kTolerance);
-  EXPECT_NEAR(both_correct_wgt, examples_[1].weight, kTolerance);
-  EXPECT_NEAR(both_correct_wgt, examples_[2].weight, kTolerance);
-  EXPECT_NEAR(second_correct_wgt, examples_[3].weight, kTolerance);
-  EXPECT_NEAR(first_correct_wgt, examples_[4].weight, kTolerance);
+  EXPECT_NEAR(both_correct_wgt, trainer.weights()[0], kTolerance);
+  EXPECT_NEAR(both_correct_wgt, trainer.weights()[1], kTolerance);
+  EXPECT_NEAR(both_correct_wgt, trainer.weights()[2], kTolerance);
+  EXPECT_NEAR(second_correct_wgt, trainer.weights()[3], kTolerance);
+  EXPECT_NEAR(first_correct_wgt, trainer.weights()[4], kTolerance);
 }
 
 TEST_F(BoostTest, TestClassifyExampleDepthOne) {
-  FLAGS_tree_depth = 1;
-  FLAGS_beta = 0;
-  FLAGS_lambda = 0;
-  FLAGS_loss_type = "exponential";
+  Trainer trainer(params_, &example_set_, &feature_index_);
   Model model;
-  AddTreeToModel(examples_, &model);
-  AddTreeToModel(examples_, &model);
+  trainer.AddTreeToModel(&model);
+  trainer.AddTreeToModel(&model);
   // By the previous test, the first tree gets example 3 wrong and has weight
   // 0.69314718056, and the second tree has weight gets example 4 wrong and has
   // weight 0.97295507452. Since 0.97295507452 > 0.69314718056, the second tree
@@ -99,12 +99,10 @@ TEST_F(BoostTest, TestClassifyExampleDepthOne) {
 }
 
 TEST_F(BoostTest, TestClassifyExampleDepthTwo) {
-  FLAGS_tree_depth = 2;
-  FLAGS_beta = 0;
-  FLAGS_lambda = 0;
-  FLAGS_loss_type = "exponential";
+  params_.tree_depth = 2;
+  Trainer trainer(params_, &example_set_, &feature_index_);
   Model model;
-  AddTreeToModel(examples_, &model);
+  trainer.AddTreeToModel(&model);
   // Depth 2 trees can classify all examples perfectly.
   EXPECT_EQ(examples_[0].label, ClassifyExample(examples_[0], model));
   EXPECT_EQ(examples_[1].label, ClassifyExample(examples_[1], model));
@@ -114,7 +112,7 @@ TEST_F(BoostTest, TestClassifyExampleDepthTwo) {
   const float alpha = model[0].first;
   // Won't actually add trees, will just increase weight on current tree.
   for (int i = 0; i < 99; ++i) {
-    AddTreeToModel(examples_, &model);
+    trainer.AddTreeToModel(&model);
   }
   EXPECT_EQ(1, model.size());
   EXPECT_NEAR(alpha, model[0].first / 100, kTolerance * 100);
@@ -136,97 +134,91 @@ TEST_F(BoostTest, TestClassifyExampleEmptyModel) {
 }
 
 TEST_F(BoostTest, TestEvaluateModelDepthOne) {
-  FLAGS_tree_depth = 1;
-  FLAGS_beta = 0;
-  FLAGS_lambda = 0;
-  FLAGS_loss_type = "exponential";
+  Trainer trainer(params_, &example_set_, &feature_index_);
   Model model;
-  AddTreeToModel(examples_, &model);
-  AddTreeToModel(examples_, &model);
+  trainer.AddTreeToModel(&model);
+  trainer.AddTreeToModel(&model);
   float error, avg_tree_size;
   int num_trees;
-  EvaluateModel(examples_, model, &error, &avg_tree_size, &num_trees);
+  EvaluateModel(example_set_, model, &error, &avg_tree_size, &num_trees);
   EXPECT_NEAR(0.2, error, kTolerance);
   EXPECT_EQ(2, num_trees);
   EXPECT_NEAR(3, avg_tree_size, kTolerance);
 }
 
 TEST_F(BoostTest, TestEvaluateModelDepthTwo) {
-  FLAGS_tree_depth = 2;
-  FLAGS_beta = 0;
-  FLAGS_lambda = 0;
-  FLAGS_loss_type = "exponential";
+  params_.tree_depth = 2;
+  Trainer trainer(params_, &example_set_, &feature_index_);
   Model model;
-  AddTreeToModel(examples_, &model);
+  trainer.AddTreeToModel(&model);
   float error, avg_tree_size;
   int num_trees;
-  EvaluateModel(examples_, model, &error, &avg_tree_size, &num_trees);
+  EvaluateModel(example_set_, model, &error, &avg_tree_size, &num_trees);
   EXPECT_NEAR(0.0, error, kTolerance);
   EXPECT_EQ(1, num_trees);
   EXPECT_NEAR(5, avg_tree_size, kTolerance);
 }
 
 TEST_F(BoostTest, ComputeEtaTest) {
-  FLAGS_beta = 1;
-  FLAGS_lambda = 1;
-  float eta = ComputeEta(1, 10, 1);
+  TreeContext context;
+  context.tree_depth = 1;
+  InitializeTreeContext(example_set_, feature_index_, example_set_.weights,
+                        &context);
+  context.normalizer = examples_.size();
+  context.beta = 1;
+  context.lambda = 1;
+  float eta = ComputeEta(context, 1, 10, 1);
   EXPECT_NEAR(-1, eta, kTolerance);
 
-  FLAGS_beta = 1;
-  FLAGS_lambda = 0;
-  eta = ComputeEta(0.1, 5, 2);
-  float ratio = ComplexityPenalty(5) / 0.1;
+  context.beta = 1;
+  context.lambda = 0;
+  eta = ComputeEta(context, 0.1, 5, 2);
+  float ratio = ComplexityPenalty(context, 5) / 0.1;
   EXPECT_NEAR(log(-ratio + sqrt(ratio * ratio + (0.9 / 0.1))), eta, kTolerance);
 
-  FLAGS_beta = 0;
-  FLAGS_lambda = 1;
-  eta = ComputeEta(0.75, 10, -10);
-  ratio = ComplexityPenalty(10) / 0.75;
+  context.beta = 0;
+  context.lambda = 1;
+  eta = ComputeEta(context, 0.75, 10, -10);
+  ratio = ComplexityPenalty(context, 10) / 0.75;
   EXPECT_NEAR(log(ratio + sqrt(ratio * ratio + (0.25 / 0.75))),
               eta, kTolerance);
 }
 
 TEST_F(BoostTest, TestAddTreeToModelLargeBeta) {
   // Large beta penalty means two trees with zero weight and depth 0.
-  FLAGS_tree_depth = 1;
-  FLAGS_beta = 100;
-  FLAGS_lambda = 0;
-  FLAGS_loss_type = "exponential";
+  params_.beta = 100;
+  Trainer trainer(params_, &example_set_, &feature_index_);
   Model model;
-  AddTreeToModel(examples_, &model);
-  AddTreeToModel(examples_, &model);
+  trainer.AddTreeToModel(&model);
+  trainer.AddTreeToModel(&model);
   EXPECT_EQ(2, model.size());
   EXPECT_LT(model[0].first, kTolerance);
-  EXPECT_LT(model[1].first, kTolerance);
+  EXPECT_NEAR(0, model[1].first, kTolerance);
   EXPECT_EQ(1, model[0].second.size());
   EXPECT_EQ(1, model[1].second.size());
 }
 
 TEST_F(BoostTest, TestAddTreeToModelLargeLambda) {
   // Large lambda penalty means two trees with zero weight and depth 0.
-  FLAGS_tree_depth = 1;
-  FLAGS_beta = 0;
-  FLAGS_lambda = 100;
-  FLAGS_loss_type = "exponential";
+  params_.lambda = 100;
+  Trainer trainer(params_, &example_set_, &feature_index_);
   Model model;
-  AddTreeToModel(examples_, &model);
-  AddTreeToModel(examples_, &model);
+  trainer.AddTreeToModel(&model);
+  trainer.AddTreeToModel(&model);
   EXPECT_EQ(2, model.size());
   EXPECT_LT(model[0].first, kTolerance);
-  EXPECT_LT(model[1].first, kTolerance);
+  EXPECT_NEAR(0, model[1].first, kTolerance);
   EXPECT_EQ(1, model[0].second.size());
   EXPECT_EQ(1, model[1].second.size());
 }
 
 TEST_F(BoostTest, TestAddTreeToModelLogisticLoss) {
-  FLAGS_tree_depth = 1;
-  FLAGS_beta = 0;
-  FLAGS_lambda = 0;
-  FLAGS_loss_type = "logistic";
+  params_.loss_type = "logistic";
+  Trainer trainer(params_, &example_set_, &feature_index_);
   Model model;
   // Train a model with a single tree. The tree's weighted error will be 0.2,
   // and it will only get example 3 wrong.
-  AddTreeToModel(examples_, &model);
+  trainer.AddTreeToModel(&model);
   // alpha1 = 0.5 * log((1 - error) / error), where error = 0.2.
   float alpha1 = 0.69314718056;
   // Normalizer is sum of all adjusted weights.
@@ -235,15 +227,15 @@ TEST_F(BoostTest, TestAddTreeToModelLogisticLoss) {
   // Adjust weights and normalize.
   float correct_wgt = (1 / (1 + exp(alpha1 - 1))) / normalizer;
   float incorrect_wgt = (1 / (1 + exp(-alpha1 - 1))) / normalizer;
-  EXPECT_NEAR(correct_wgt, examples_[0].weight, kTolerance);
-  EXPECT_NEAR(correct_wgt, examples_[1].weight, kTolerance);
-  EXPECT_NEAR(correct_wgt, examples_[2].weight, kTolerance);
-  EXPECT_NEAR(incorrect_wgt, examples_[3].weight, kTolerance);
-  EXPECT_NEAR(correct_wgt, examples_[4].weight, kTolerance);
+  EXPECT_NEAR(correct_wgt, trainer.weights()[0], kTolerance);
+  EXPECT_NEAR(correct_wgt, trainer.weights()[1], kTolerance);
+  EXPECT_NEAR(correct_wgt, trainer.weights()[2], kTolerance);
+  EXPECT_NEAR(incorrect_wgt, trainer.weights()[3], kTolerance);
+  EXPECT_NEAR(correct_wgt, trainer.weights()[4], kTolerance);
 
   // Add another tree to the model. The tree's weighted error will be
   // 0.182946235, and it will only get example 4 wrong.
-  AddTreeToModel(examples_, &model);
+  trainer.AddTreeToModel(&model);
   // alpha2 = 0.5 * log((1 - error) / error), where error = 0.182946235.
   float alpha2 = 0.7482563445;
   // Normalizer is sum of all adjusted weights.
@@ -253,9 +245,135 @@ TEST_F(BoostTest, TestAddTreeToModelLogisticLoss) {
   float both_correct_wgt = (1 / (1 + exp(alpha1 + alpha2 - 1))) / normalizer;
   float first_correct_wgt = (1 / (1 + exp(alpha1 - alpha2 - 1))) / normalizer;
   float second_correct_wgt = (1 / (1 + exp(-alpha1 + alpha2 - 1))) / normalizer;
-  EXPECT_NEAR(both_correct_wgt, examples_[0].weight, kTolerance);
-  EXPECT_NEAR(both_correct_wgt, examples_[1].weight, kTolerance);
-  EXPECT_NEAR(both_correct_wgt, examples_[2].weight, kTolerance);
-  EXPECT_NEAR(second_correct_wgt, examples_[3].weight, kTolerance);
-  EXPECT_NEAR(first_correct_wgt, examples_[4].weight, kTolerance);
+  EXPECT_NEAR(both_correct_wgt, trainer.weights()[0], kTolerance);
+  EXPECT_NEAR(both_correct_wgt, trainer.weights()[1], kTolerance);
+  EXPECT_NEAR(both_correct_wgt, trainer.weights()[2], kTolerance);
+  EXPECT_NEAR(second_correct_wgt, trainer.weights()[3], kTolerance);
+  EXPECT_NEAR(first_correct_wgt, trainer.weights()[4], kTolerance);
+}
+
+TEST_F(BoostTest, TestModelEvaluator) {
+  Trainer trainer(params_, &example_set_, &feature_index_);
+  // Evaluate on a set of some of the examples.
+  const ExampleSet test_examples =
+      MakeExampleSet({examples_[1], examples_[3], examples_[4]});
+  ModelEvaluator evaluator(&test_examples);
+  Model model;
+  // The evaluator should agree with EvaluateModel() as trees are added to the
+  // model and existing trees are reweighted.
+  for (int i = 0; i < 10; ++i) {
+    trainer.AddTreeToModel(&model);
+    float error, avg_tree_size, expected_error, expected_avg_tree_size;
+    int num_trees, expected_num_trees;
+    evaluator.Evaluate(model, &error, &avg_tree_size, &num_trees);
+    EvaluateModel(test_examples, model, &expected_error,
+                  &expected_avg_tree_size, &expected_num_trees);
+    EXPECT_NEAR(expected_error, error, kTolerance);
+    EXPECT_NEAR(expected_avg_tree_size, avg_tree_size, kTolerance);
+    EXPECT_EQ(expected_num_trees, num_trees);
+  }
+}
+
+TEST_F(BoostTest, TestAddTreeToModelWeightsStayNormalized) {
+  // Enough examples for several blocks of weights and a partial block.
+  vector<Example> examples;
+  for (int i = 0; i < 4; ++i) {
+    for (const Example& example : examples_) {
+      examples.push_back(example);
+      examples.back().values[0] += 0.1 * i;
+      examples.back().weight = 1.0 / (4 * examples_.size());
+    }
+  }
+  for (const char* loss_type : {"exponential", "logistic"}) {
+    params_.loss_type = loss_type;
+    const ExampleSet example_set = MakeExampleSet(examples);
+    const FeatureIndex feature_index = MakeFeatureIndex(example_set);
+    Trainer trainer(params_, &example_set, &feature_index);
+    Model model;
+    for (int i = 0; i < 5; ++i) {
+      trainer.AddTreeToModel(&model);
+      float sum = 0;
+      for (Weight weight : trainer.weights()) {
+        EXPECT_LT(0, weight);
+        sum += weight;
+      }
+      EXPECT_NEAR(1, sum, 10 * kTolerance);
+    }
+  }
+}
+
+TEST_F(BoostTest, TestConcurrentTrainers) {
+  // Models trained at the same time on the same examples should be the same as
+  // models trained one after the other.
+  ModelParams other_params = params_;
+  other_params.loss_type = "logistic";
+  other_params.tree_depth = 2;
+  Trainer trainer(params_, &example_set_, &feature_index_);
+  Trainer other_trainer(other_params, &example_set_, &feature_index_);
+  Model model, other_model;
+  for (int i = 0; i < 5; ++i) {
+    trainer.AddTreeToModel(&model);
+    other_trainer.AddTreeToModel(&other_model);
+  }
+  Model concurrent_model, other_concurrent_model;
+  Trainer concurrent_trainer(params_, &example_set_, &feature_index_);
+  Trainer other_concurrent_trainer(other_params, &example_set_,
+                                   &feature_index_);
+  std::thread thread([&]() {
+    for (int i = 0; i < 5; ++i) {
+      concurrent_trainer.AddTreeToModel(&concurrent_model);
+    }
+  });
+  for (int i = 0; i < 5; ++i) {
+    other_concurrent_trainer.AddTreeToModel(&other_concurrent_model);
+  }
+  thread.join();
+  ASSERT_EQ(model.size(), concurrent_model.size());
+  for (size_t i = 0; i < model.size(); ++i) {
+    EXPECT_EQ(model[i].first, concurrent_model[i].first);
+    EXPECT_EQ(model[i].second.size(), concurrent_model[i].second.size());
+  }
+  ASSERT_EQ(other_model.size(), other_concurrent_model.size());
+  for (size_t i = 0; i < other_model.size(); ++i) {
+    EXPECT_EQ(other_model[i].first, other_concurrent_model[i].first);
+    EXPECT_EQ(other_model[i].second.size(),
+              other_concurrent_model[i].second.size());
+  }
+  EXPECT_EQ(trainer.weights(), concurrent_trainer.weights());
+  EXPECT_EQ(other_trainer.weights(), other_concurrent_trainer.weights());
+}
+
+TEST_F(BoostTest, TestAddTreeToModelMultiThreaded) {
+  // Old trees are evaluated in parallel, and at the same time as the new tree
+  // is trained, but the model should be the same as with one thread.
+  vector<Example> examples;
+  for (int i = 0; i < 4; ++i) {
+    for (const Example& example : examples_) {
+      examples.push_back(example);
+      examples.back().values[0] += 0.1 * i;
+      examples.back().weight = 1.0 / (4 * examples_.size());
+    }
+  }
+  const ExampleSet example_set = MakeExampleSet(examples);
+  const FeatureIndex feature_index = MakeFeatureIndex(example_set);
+  Trainer trainer(params_, &example_set, &feature_index);
+  Model model;
+  for (int i = 0; i < 20; ++i) {
+    trainer.AddTreeToModel(&model);
+  }
+  // Some iterations reweight old trees instead of adding new ones.
+  EXPECT_GT(20, model.size());
+  FLAGS_num_threads = 4;
+  Trainer parallel_trainer(params_, &example_set, &feature_index);
+  Model parallel_model;
+  for (int i = 0; i < 20; ++i) {
+    parallel_trainer.AddTreeToModel(&parallel_model);
+  }
+  FLAGS_num_threads = 1;
+  ASSERT_EQ(model.size(), parallel_model.size());
+  for (size_t i = 0; i < model.size(); ++i) {
+    EXPECT_EQ(model[i].first, parallel_model[i].first);
+    EXPECT_EQ(model[i].second.size(), parallel_model[i].second.size());
+  }
+  EXPECT_EQ(trainer.weights(), parallel_trainer.weights());
 }
@@ -0,0 +1,45 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "io.h"
+#include "types.h"
+
+// Converts a data file in one of the text formats read by ReadExamples() into
+// the binary format, so that later runs of the driver on the same data set can
+// skip text parsing. Run the driver on the output with --data_set=binary.
+
+DECLARE_string(data_set);
+DECLARE_string(data_filename);
+DEFINE_string(output_filename, "",
+              "File to write the binary data to. Required: output_filename "
+              "not empty.");
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  CHECK(!FLAGS_data_filename.empty());
+  CHECK(!FLAGS_output_filename.empty());
+  CHECK_NE(FLAGS_data_set, "binary");
+
+  vector<Example> examples;
+  ReadExamples(&examples);
+  WriteBinaryData(examples, FLAGS_output_filename);
+  printf("Wrote %d examples to %s\n", static_cast<int>(examples.size()),
+         FLAGS_output_filename.c_str());
+}
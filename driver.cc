@@ -18,31 +18,46 @@ limitations under the License.
 #include "glog/logging.h"
 #include "boost.h"
 #include "io.h"
+#include "tree.h"
 #include "types.h"
 
-DECLARE_int32(tree_depth);
+DECLARE_int32(max_bins);
+DECLARE_int32(num_threads);
 DECLARE_string(data_set);
 DECLARE_string(data_filename);
 DECLARE_int32(num_folds);
 DECLARE_int32(fold_to_cv);
 DECLARE_int32(fold_to_test);
-DECLARE_double(beta);
-DECLARE_double(lambda);
-DECLARE_string(loss_type);
+DEFINE_string(loss_type, "",
+              "Loss type. Required: One of exponential, logistic.");
+DEFINE_double(beta, -1.0, "beta parameter for gradient.");
+DEFINE_double(lambda, -1.0, "lambda parameter for gradient.");
+DEFINE_int32(tree_depth, -1,
+             "Maximum depth of each decision tree. The root node has depth 0. "
+             "Required: tree_depth >= 0.");
 DEFINE_int32(num_iter, -1,
              "Number of boosting iterations. Required: num_iter >= 1.");
 DEFINE_int32(seed, -1,
              "Seed for random number generator. Required: seed >= 0.");
+DEFINE_bool(train_on_disk, false,
+            "If true, the feature values of the training examples are read "
+            "from disk as trees are trained, rather than held in memory. "
+            "The model is the same as when training in memory, up to "
+            "floating-point summation order. Required: data_set is binary "
+            "and max_bins >= 1 if true.");
 
 void ValidateFlags() {
   CHECK_GE(FLAGS_tree_depth, 0);
+  CHECK_GE(FLAGS_max_bins, 0);
+  CHECK_GE(FLAGS_num_threads, 1);
   CHECK_GE(FLAGS_num_iter, 1);
   CHECK(!FLAGS_data_filename.empty());
-  CHECK(FLAGS_dataset == "breastcancer" || FLAGS_dataset == "ionosphere" ||
-        FLAGS_dataset == "ocr17-mnist" || FLAGS_dataset == "ocr49-mnist" ||
-        FLAGS_dataset == "splice" || FLAGS_dataset == "german" ||
-        FLAGS_dataset == "ocr17" || FLAGS_dataset == "ocr49" ||
-        FLAGS_dataset == "diabetes");
+  CHECK(FLAGS_data_set == "breastcancer" || FLAGS_data_set == "ionosphere" ||
+        FLAGS_data_set == "ocr17-mnist" || FLAGS_data_set == "ocr49-mnist" ||
+        FLAGS_data_set == "splice" || FLAGS_data_set == "german" ||
+        FLAGS_data_set == "ocr17" || FLAGS_data_set == "ocr49" ||
+        FLAGS_data_set == "diabetes" || FLAGS_data_set == "custom" ||
+        FLAGS_data_set == "binary" || FLAGS_data_set == "libsvm");
   CHECK_GE(FLAGS_num_folds, 3);
   CHECK_GE(FLAGS_fold_to_cv, 0);
   CHECK_GE(FLAGS_fold_to_test, 0);
@@ -52,6 +67,13 @@ void ValidateFlags() {
   CHECK_GE(FLAGS_beta, 0.0);
   CHECK_GE(FLAGS_lambda, 0.0);
   CHECK(FLAGS_loss_type == "exponential" || FLAGS_loss_type == "logistic");
+  if (FLAGS_data_set == "libsvm") {
+    CHECK_GE(FLAGS_max_bins, 1) << "Sparse data sets require --max_bins >= 1";
+  }
+  if (FLAGS_train_on_disk) {
+    CHECK_EQ(FLAGS_data_set, "binary");
+    CHECK_GE(FLAGS_max_bins, 1);
+  }
 }
 
 int main(int argc, char** argv) {
@@ -62,21 +84,32 @@ int main(int argc, char** argv) {
 
   SetSeed(FLAGS_seed);
 
-  vector<Example> train_examples, cv_examples, test_examples;
-  ReadData(&train_examples, &cv_examples, &test_examples);
+  DataSet data_set;
+  DiskColumns train_columns;
+  FeatureIndex feature_index;
+  if (FLAGS_train_on_disk) {
+    ReadDataSetOnDisk(&data_set, &train_columns);
+    feature_index = MakeDiskFeatureIndex(&train_columns);
+  } else {
+    ReadDataSet(&data_set);
+    feature_index = MakeFeatureIndex(data_set.train);
+  }
+
+  ModelParams params;
+  params.loss_type = FLAGS_loss_type;
+  params.beta = FLAGS_beta;
+  params.lambda = FLAGS_lambda;
+  params.tree_depth = FLAGS_tree_depth;
+  Trainer trainer(params, &data_set.train, &feature_index);
 
   Model model;
+  ModelEvaluator cv_evaluator(&data_set.cv), test_evaluator(&data_set.test);
   for (int iter = 1; iter <= FLAGS_num_iter; ++iter) {
-    AddTreeToModel(train_examples, &model);
-    // TODO(usyed): Evaluating every iteration might be very expensive. Add an
-    // option to evaluate every K iterations, where K is a command-line
-    // parameter.
+    trainer.AddTreeToModel(&model);
     float cv_error, test_error, avg_tree_size;
     int num_trees;
-    EvaluateModel(cv_examples, model, &cv_error, &avg_tree_size,
-                  &num_trees);
-    EvaluateModel(test_examples, model, &test_error, &avg_tree_size,
-                  &num_trees);
+    cv_evaluator.Evaluate(model, &cv_error, &avg_tree_size, &num_trees);
+    test_evaluator.Evaluate(model, &test_error, &avg_tree_size, &num_trees);
     printf("Iteration: %d, test error: %g, cv error: %g, "
            "avg tree size: %g, num trees: %d\n",
            iter, test_error, cv_error, avg_tree_size, num_trees);
@@ -16,16 +16,32 @@ limitations under the License.
 
 #include "io.h"
 
+#include <fcntl.h>
+#include <locale.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <fstream>
+#include <iterator>
+#include <numeric>
 #include <random>
+#include <utility>
 
 #include "gflags/gflags.h"
 #include "glog/logging.h"
+#include "parallel.h"
 
 DEFINE_string(data_set, "",
               "Name of data set. Required: One of breastcancer, ionosphere, "
-              "ocr17, ocr49, ocr17-mnist, ocr49-mnist, diabetes, german.");
+              "ocr17, ocr49, ocr17-mnist, ocr49-mnist, diabetes, german, "
+              "custom, libsvm, binary. Use custom for a text file described by "
+              "the custom_* flags, libsvm for a sparse file in libsvm format, "
+              "and binary for a file written by convert_data.");
 DEFINE_string(data_filename, "",
               "Filename containing data. Required: data_filename not empty.");
 DEFINE_int32(num_folds, -1,
@@ -41,12 +57,55 @@ DEFINE_int32(fold_to_test, -1,
 DEFINE_double(noise_prob, 0,
               "Noise probability. Required: 0 <= noise_prob <= 1.");
 
+DEFINE_string(custom_delimiter, ",",
+              "Delimiter between the columns of a custom data set. One of , "
+              "space ; | or tab.");
+DEFINE_string(custom_skip_columns, "",
+              "Comma-separated zero-indexed columns of a custom data set that "
+              "are ignored, e.g. an ID column.");
+DEFINE_int32(custom_label_column, -1,
+             "Zero-indexed column of the label of a custom data set, or -1 "
+             "for the last column.");
+DEFINE_string(custom_negative_labels, "",
+              "Comma-separated labels of the negative examples of a custom "
+              "data set. Required if data_set is custom.");
+DEFINE_string(custom_positive_labels, "",
+              "Comma-separated labels of the positive examples of a custom "
+              "data set. Required if data_set is custom.");
+DEFINE_bool(custom_drop_unknown_labels, false,
+            "If true, examples of a custom data set whose label is neither "
+            "negative nor positive are dropped. Otherwise they are an error.");
+DEFINE_string(custom_missing_value, "",
+              "If not empty, examples of a custom data set with a feature "
+              "equal to this value are dropped.");
+
+// Approximate size in bytes of the chunks of a data file that are parsed in
+// parallel.
+static const size_t kChunkSize = 1 << 22;
+
+// Number of examples of a binary data file that are copied in one task.
+static const int64_t kBinaryChunkSize = 1 << 12;
+
+// Identifies the format and version of a binary data file.
+static const char kBinaryDataMagic[] = "DBOOSTB1";
+
+// Header of a binary data file. It is followed by the label of each example,
+// as an int32_t that is -1 or +1, and then by the values of each feature for
+// all examples, as floats. Examples are in the order of the text file they
+// were converted from.
+typedef struct BinaryDataHeader {
+  char magic[8];  // kBinaryDataMagic
+  int64_t num_examples;
+  int32_t num_features;
+  int32_t reserved;  // Always zero
+} BinaryDataHeader;
+
 static std::mt19937 rng;
 
 void SetSeed(uint_fast32_t seed) { rng.seed(seed); }
 
 void SplitString(const string &text, char sep, vector<string>* tokens) {
-  int start = 0, end = 0;
+  size_t start = 0, end = 0;
   string token;
   while ((end = text.find(sep, start)) != string::npos) {
     token = text.substr(start, end - start);
@@ -61,236 +120,841 @@ void SplitString(const string &text, char sep, vector<string>* tokens) {
   }
 }
 
-bool ParseLineBreastCancer(const string& line, Example* example) {
-  example->values.clear();
-  vector<string> values;
-  SplitString(line, ',', &values);
-  for (int i = 0; i < values.size(); ++i) {
-    if (i == 0) {
-      continue;  // Skip ID
-    } else if (i == values.size() - 1) {
-      if (values[i] == "2") {  // Benign
-        example->label = -1;
-      } else if (values[i] == "4") {  // Malignant
-        example->label = +1;
-      } else {
-        LOG(FATAL) << "Unexpected label: " << values[i];
-      }
-    } else if (values[i] == "?") {
-      return false;
-    } else {
-      float value = atof(values[i].c_str());
-      example->values.push_back(value);
+// A token of a line of text. Points into the line, and is not null-terminated.
+typedef struct Token {
+  const char* begin;
+  const char* end;
+} Token;
+
+// Split the line that starts at begin into tokens, using kSep as a delimiter.
+// Consecutive delimiters are ignored, as in SplitString(). Returns the end of
+// the line, which is the first newline at or after begin, or end if there is
+// none. The delimiter is a template parameter so that each delimiter gets its
+// own loop, which finds delimiters and the newline in a single pass.
+template <char kSep>
+static const char* SplitLine(const char* begin, const char* end,
+                             vector<Token>* tokens) {
+  tokens->clear();
+  const char* start = begin;
+  const char* p = begin;
+  for (; p < end && *p != '\n'; ++p) {
+    if (*p == kSep) {
+      if (p > start) tokens->push_back({start, p});
+      start = p + 1;
     }
   }
-  return true;
+  if (p > start) tokens->push_back({start, p});
+  return p;
 }
 
-bool ParseLineIon(const string& line, Example* example) {
-  example->values.clear();
-  vector<string> values;
-  SplitString(line, ',', &values);
-  for (int i = 0; i < values.size(); ++i) {
-    if (i == values.size() - 1) {
-      if (values[i] == "b") {  // Bad
-        example->label = -1;
-      } else if (values[i] == "g") {  // Good
-        example->label = +1;
-      } else {
-        LOG(FATAL) << "Unexpected label: " << values[i];
-      }
-    } else {
-      float value = atof(values[i].c_str());
-      example->values.push_back(value);
-    }
+static bool TokenEquals(const Token& token, const string& text) {
+  return static_cast<size_t>(token.end - token.begin) == text.size() &&
+         memcmp(token.begin, text.data(), text.size()) == 0;
+}
+
+static bool TokenIn(const Token& token, const vector<string>& texts) {
+  for (const string& text : texts) {
+    if (TokenEquals(token, text)) return true;
   }
-  return true;
+  return false;
 }
 
-bool ParseLineGerman(const string& line, Example* example) {
-  example->values.clear();
-  vector<string> values;
-  SplitString(line, ' ', &values);
-  for (int i = 0; i < values.size(); ++i) {
-    if (i == values.size() - 1) {
-      if (values[i] == "1") {  // Good
-        example->label = -1;
-      } else if (values[i] == "2") {  // Bad
-        example->label = +1;
-      } else {
-        LOG(FATAL) << "Unexpected label: " << values[i];
+// Powers of ten that are exactly representable as doubles.
+static const double kExactPowersOfTen[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+Value ParseValue(const char* begin, const char* end) {
+  // Fast path for plain decimal numbers whose digits fit exactly in a double
+  // and whose exponent is a power of ten that is exact in a double. The
+  // result of a single multiplication or division is then correctly rounded,
+  // so it is the same as the result of strtod.
+  const char* p = begin;
+  const bool negative = (p < end && *p == '-');
+  if (p < end && (*p == '-' || *p == '+')) ++p;
+  uint64_t mantissa = 0;
+  int exponent = 0;
+  int num_digits = 0;
+  bool fast = true;
+  for (; p < end && *p >= '0' && *p <= '9'; ++p, ++num_digits) {
+    if (mantissa >= (1ULL << 53) / 10) fast = false;
+    mantissa = 10 * mantissa + (*p - '0');
+  }
+  if (p < end && *p == '.') {
+    for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++num_digits) {
+      if (mantissa >= (1ULL << 53) / 10) fast = false;
+      mantissa = 10 * mantissa + (*p - '0');
+      --exponent;
+    }
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    ++p;
+    const bool negative_exponent = (p < end && *p == '-');
+    if (p < end && (*p == '-' || *p == '+')) ++p;
+    if (p == end) fast = false;
+    int explicit_exponent = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+      // Any exponent this large is out of range, so later digits are not
+      // accumulated, which would overflow.
+      if (explicit_exponent > 1000) {
+        fast = false;
+        continue;
       }
+      explicit_exponent = 10 * explicit_exponent + (*p - '0');
+    }
+    exponent += negative_exponent ? -explicit_exponent : explicit_exponent;
+  }
+  if (fast && num_digits > 0 && p == end && exponent >= -22 &&
+      exponent <= 22) {
+    double value = static_cast<double>(mantissa);
+    if (exponent < 0) {
+      value /= kExactPowersOfTen[-exponent];
     } else {
-      float value = atof(values[i].c_str());
-      example->values.push_back(value);
+      value *= kExactPowersOfTen[exponent];
     }
+    return negative ? -value : value;
   }
-  return true;
+  // Fall back to strtod, which needs a null-terminated copy of the token. It
+  // parses in the "C" locale, whatever the locale of the process.
+  static const locale_t c_locale = newlocale(LC_ALL_MASK, "C", nullptr);
+  const string text(begin, end);
+  return strtod_l(text.c_str(), nullptr, c_locale);
 }
 
-bool ParseLineOcr17(const string& line, Example* example) {
-  example->values.clear();
-  vector<string> values;
-  SplitString(line, ',', &values);
-  for (int i = 0; i < values.size(); ++i) {
-    if (i == values.size() - 1) {
-      if (values[i] == "1") {  // Digit 1
-        example->label = -1;
-      } else if (values[i] == "7") {  // Digit 7
-        example->label = +1;
-      } else {
+static Value ParseValue(const Token& token) {
+  return ParseValue(token.begin, token.end);
+}
+
+// Parse the tokens of one line into example, as described by format. skip[i]
+// is true if column i is skipped, for the columns that skip covers. Returns
+// false if the example should be dropped. If example is null, only whether the
+// example should be dropped is found, and no values are parsed.
+static bool ParseTokens(const vector<Token>& tokens, const DataFormat& format,
+                        const vector<bool>& skip, Example* example) {
+  if (example != nullptr) example->values.clear();
+  if (tokens.empty()) return false;  // Blank line
+  const size_t label_column = (format.label_column < 0)
+                                  ? tokens.size() - 1
+                                  : static_cast<size_t>(format.label_column);
+  if (label_column >= tokens.size()) {
+    if (format.drop_unknown_labels) return false;
+    LOG(FATAL) << "Missing label in column " << label_column;
+  }
+  Label label = 0;
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    if (i == label_column) {
+      if (TokenIn(tokens[i], format.negative_labels)) {
+        label = -1;
+      } else if (TokenIn(tokens[i], format.positive_labels)) {
+        label = +1;
+      } else if (format.drop_unknown_labels) {
         return false;
+      } else {
+        LOG(FATAL) << "Unexpected label: "
+                   << string(tokens[i].begin, tokens[i].end);
       }
-    } else {
-      float value = atof(values[i].c_str());
-      example->values.push_back(value);
+    } else if (i < skip.size() && skip[i]) {
+      continue;
+    } else if (!format.missing_value.empty() &&
+               TokenEquals(tokens[i], format.missing_value)) {
+      return false;
+    } else if (example != nullptr) {
+      example->values.push_back(ParseValue(tokens[i]));
     }
   }
+  if (example != nullptr) example->label = label;
   return true;
 }
 
-bool ParseLineOcr49(const string& line, Example* example) {
-  example->values.clear();
-  vector<string> values;
-  SplitString(line, ',', &values);
-  for (int i = 0; i < values.size(); ++i) {
-    if (i == values.size() - 1) {
-      if (values[i] == "4") {  // Digit 4
-        example->label = -1;
-      } else if (values[i] == "9") {  // Digit 9
-        example->label = +1;
-      } else {
-        return false;
-      }
-    } else {
-      float value = atof(values[i].c_str());
-      example->values.push_back(value);
+// Return skip for ParseTokens(), given format.
+static vector<bool> MakeSkipColumns(const DataFormat& format) {
+  vector<bool> skip;
+  for (int column : format.skip_columns) {
+    if (column >= static_cast<int>(skip.size())) {
+      skip.resize(column + 1, false);
     }
+    skip[column] = true;
   }
-  return true;
+  return skip;
 }
 
-bool ParseLineOcr17Princeton(const string& line, Example* example) {
-  example->values.clear();
-  vector<string> values;
-  SplitString(line, ' ', &values);
-  for (int i = 0; i < values.size(); ++i) {
-    if (i == values.size() - 1) {
-      if (values[i] == "1") {  // Digit 1
-        example->label = -1;
-      } else if (values[i] == "7") {  // Digit 7
-        example->label = +1;
-      } else {
-        return false;
-      }
+// Call visit(tokens) with the tokens of each line in [begin, end), split with
+// SplitLine<kSep>(). A final line without a trailing newline is ignored.
+template <char kSep, typename Visit>
+static void ForEachLine(const char* begin, const char* end, Visit visit) {
+  vector<Token> tokens;
+  const char* line = begin;
+  while (line < end) {
+    const char* line_end = SplitLine<kSep>(line, end, &tokens);
+    if (line_end == end) break;
+    visit(tokens);
+    line = line_end + 1;
+  }
+}
+
+// Same as ForEachLine<kSep>(), for delimiter sep. Each delimiter gets its own
+// instance of the loop.
+template <typename Visit>
+static void ForEachLine(char sep, const char* begin, const char* end,
+                        Visit visit) {
+  switch (sep) {
+    case ',':
+      return ForEachLine<','>(begin, end, visit);
+    case ' ':
+      return ForEachLine<' '>(begin, end, visit);
+    case '\t':
+      return ForEachLine<'\t'>(begin, end, visit);
+    case ';':
+      return ForEachLine<';'>(begin, end, visit);
+    case '|':
+      return ForEachLine<'|'>(begin, end, visit);
+    default:
+      LOG(FATAL) << "Unsupported delimiter: '" << sep << "'";
+  }
+}
+
+// Parse the lines in [begin, end) with format, and append the examples to
+// keep to examples. A final line without a trailing newline is ignored.
+static void ParseLines(const char* begin, const char* end,
+                       const DataFormat& format, vector<Example>* examples) {
+  const vector<bool> skip = MakeSkipColumns(format);
+  ForEachLine(format.delimiter, begin, end, [&](const vector<Token>& tokens) {
+    Example example;
+    if (ParseTokens(tokens, format, skip, &example)) {
+      examples->push_back(std::move(example));
+    }
+  });
+}
+
+// Return a format whose label is in the last column and whose other columns
+// are all features.
+static DataFormat MakeDataFormat(char delimiter, const string& negative_label,
+                                 const string& positive_label,
+                                 bool drop_unknown_labels) {
+  DataFormat format;
+  format.delimiter = delimiter;
+  format.label_column = -1;
+  format.negative_labels.push_back(negative_label);
+  format.positive_labels.push_back(positive_label);
+  format.drop_unknown_labels = drop_unknown_labels;
+  return format;
+}
+
+DataFormat GetDataFormat(const string& data_set) {
+  if (data_set == "breastcancer") {
+    // Benign is negative, malignant is positive.
+    DataFormat format = MakeDataFormat(',', "2", "4", false);
+    format.skip_columns.push_back(0);  // Skip ID
+    format.missing_value = "?";
+    return format;
+  } else if (data_set == "ionosphere") {
+    return MakeDataFormat(',', "b", "g", false);  // Bad, good
+  } else if (data_set == "german") {
+    return MakeDataFormat(' ', "1", "2", false);  // Good, bad
+  } else if (data_set == "ocr17-mnist") {
+    return MakeDataFormat(',', "1", "7", true);
+  } else if (data_set == "ocr49-mnist") {
+    return MakeDataFormat(',', "4", "9", true);
+  } else if (data_set == "ocr17") {
+    return MakeDataFormat(' ', "1", "7", true);
+  } else if (data_set == "ocr49") {
+    return MakeDataFormat(' ', "4", "9", true);
+  } else if (data_set == "diabetes") {
+    return MakeDataFormat(',', "0", "1", false);
+  } else if (data_set == "custom") {
+    DataFormat format;
+    if (FLAGS_custom_delimiter == "tab") {
+      format.delimiter = '\t';
     } else {
-      float value = atof(values[i].c_str());
-      example->values.push_back(value);
+      CHECK_EQ(1, FLAGS_custom_delimiter.size())
+          << "Invalid delimiter: " << FLAGS_custom_delimiter;
+      format.delimiter = FLAGS_custom_delimiter[0];
+    }
+    vector<string> columns;
+    SplitString(FLAGS_custom_skip_columns, ',', &columns);
+    for (const string& column : columns) {
+      format.skip_columns.push_back(atoi(column.c_str()));
+      CHECK_GE(format.skip_columns.back(), 0);
     }
+    format.label_column = FLAGS_custom_label_column;
+    SplitString(FLAGS_custom_negative_labels, ',', &format.negative_labels);
+    SplitString(FLAGS_custom_positive_labels, ',', &format.positive_labels);
+    CHECK(!format.negative_labels.empty() && !format.positive_labels.empty())
+        << "custom_negative_labels and custom_positive_labels are required";
+    format.drop_unknown_labels = FLAGS_custom_drop_unknown_labels;
+    format.missing_value = FLAGS_custom_missing_value;
+    return format;
   }
+  LOG(FATAL) << "Unknown data set: " << data_set;
+  return DataFormat();
+}
+
+bool ParseLine(const string& line, const DataFormat& format,
+               Example* example) {
+  const string text = line + '\n';
+  vector<Example> examples;
+  ParseLines(text.data(), text.data() + text.size(), format, &examples);
+  if (examples.empty()) return false;
+  *example = std::move(examples[0]);
   return true;
 }
 
-bool ParseLineOcr49Princeton(const string& line, Example* example) {
-  example->values.clear();
-  vector<string> values;
-  SplitString(line, ' ', &values);
-  for (int i = 0; i < values.size(); ++i) {
-    if (i == values.size() - 1) {
-      if (values[i] == "4") {  // Digit 4
-        example->label = -1;
-      } else if (values[i] == "9") {  // Digit 9
-        example->label = +1;
-      } else {
-        return false;
+// Map the file filename into memory, read-only, and set size to its size in
+// bytes. Returns nullptr for an empty file.
+static const char* MapFile(const string& filename, size_t* size) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  CHECK_GE(fd, 0) << "Could not open " << filename;
+  struct stat file_stat;
+  CHECK_EQ(0, fstat(fd, &file_stat));
+  *size = file_stat.st_size;
+  void* data = nullptr;
+  if (*size > 0) {
+    data = mmap(nullptr, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    CHECK(data != MAP_FAILED) << "Could not map " << filename;
+    madvise(data, *size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  return static_cast<const char*>(data);
+}
+
+static void UnmapFile(const char* data, size_t size) {
+  if (size > 0) munmap(const_cast<char*>(data), size);
+}
+
+// Split the size bytes of text at data into chunks of about kChunkSize bytes
+// that start at line boundaries. Chunk i is [chunks[i], chunks[i + 1]).
+static vector<const char*> SplitIntoChunks(const char* data, size_t size) {
+  const int num_chunks = std::max<size_t>(1, size / kChunkSize);
+  vector<const char*> chunk_begins(num_chunks + 1, data + size);
+  chunk_begins[0] = data;
+  for (int i = 1; i < num_chunks; ++i) {
+    const char* begin = std::max(data + i * (size / num_chunks),
+                                 chunk_begins[i - 1]);
+    const char* newline =
+        static_cast<const char*>(memchr(begin, '\n', data + size - begin));
+    chunk_begins[i] = (newline == nullptr) ? data + size : newline + 1;
+  }
+  return chunk_begins;
+}
+
+// Read the examples of the text data file of data set --data_set.
+static void ReadTextExamples(vector<Example>* examples) {
+  const DataFormat format = GetDataFormat(FLAGS_data_set);
+  size_t size;
+  const char* data = MapFile(FLAGS_data_filename, &size);
+  // Parse the chunks in parallel, and concatenate their examples in file
+  // order.
+  const vector<const char*> chunk_begins = SplitIntoChunks(data, size);
+  const int num_chunks = chunk_begins.size() - 1;
+  vector<vector<Example>> chunk_examples(num_chunks);
+  ParallelFor(num_chunks, [&](int i) {
+    ParseLines(chunk_begins[i], chunk_begins[i + 1], format,
+               &chunk_examples[i]);
+  });
+  for (vector<Example>& chunk : chunk_examples) {
+    std::move(chunk.begin(), chunk.end(), std::back_inserter(*examples));
+    vector<Example>().swap(chunk);
+  }
+  UnmapFile(data, size);
+}
+
+// Map the binary data file filename into memory and check its header. Sets
+// size to the size of the mapping, and labels and columns to the arrays in it.
+static const char* MapBinaryData(const string& filename, size_t* size,
+                                 BinaryDataHeader* header,
+                                 const int32_t** labels,
+                                 const float** columns) {
+  const char* data = MapFile(filename, size);
+  CHECK_GE(*size, sizeof(BinaryDataHeader)) << "Truncated binary data file";
+  memcpy(header, data, sizeof(*header));
+  CHECK_EQ(0, memcmp(header->magic, kBinaryDataMagic, sizeof(header->magic)))
+      << "Not a binary data file: " << filename;
+  CHECK_EQ(*size, sizeof(*header) + header->num_examples * sizeof(int32_t) +
+                      header->num_features * header->num_examples *
+                          sizeof(float))
+      << "Truncated binary data file";
+  *labels = reinterpret_cast<const int32_t*>(data + sizeof(*header));
+  *columns = reinterpret_cast<const float*>(*labels + header->num_examples);
+  return data;
+}
+
+// Read the examples of a binary data file written by WriteBinaryData().
+static void ReadBinaryExamples(vector<Example>* examples) {
+  size_t size;
+  BinaryDataHeader header;
+  const int32_t* labels;
+  const float* columns;
+  const char* data = MapBinaryData(FLAGS_data_filename, &size, &header,
+                                   &labels, &columns);
+  const int64_t num_examples = header.num_examples;
+  const int num_features = header.num_features;
+  examples->resize(num_examples);
+  const int num_chunks = (num_examples + kBinaryChunkSize - 1) /
+                         kBinaryChunkSize;
+  ParallelFor(num_chunks, [&](int chunk) {
+    const int64_t begin = chunk * kBinaryChunkSize;
+    const int64_t end = std::min(begin + kBinaryChunkSize, num_examples);
+    for (int64_t i = begin; i < end; ++i) {
+      Example& example = (*examples)[i];
+      example.label = labels[i];
+      example.values.resize(num_features);
+      for (Feature j = 0; j < num_features; ++j) {
+        example.values[j] = columns[j * num_examples + i];
       }
-    } else {
-      float value = atof(values[i].c_str());
-      example->values.push_back(value);
     }
+  });
+  UnmapFile(data, size);
+}
+
+// Parse the tokens of one line of a libsvm data file, a label followed by
+// feature:value pairs with one-based features, into example and its feature
+// values. Returns false for a blank line.
+static bool ParseLibSvmTokens(const vector<Token>& tokens, Example* example,
+                              vector<pair<Feature, Value>>* row) {
+  row->clear();
+  if (tokens.empty()) return false;  // Blank line
+  example->label = (ParseValue(tokens[0]) > 0) ? 1 : -1;
+  for (size_t i = 1; i < tokens.size(); ++i) {
+    const Token& token = tokens[i];
+    const char* colon = static_cast<const char*>(
+        memchr(token.begin, ':', token.end - token.begin));
+    CHECK(colon != nullptr && colon > token.begin)
+        << "Invalid feature: " << string(token.begin, token.end);
+    int64_t index = 0;
+    for (const char* p = token.begin; p < colon; ++p) {
+      CHECK(*p >= '0' && *p <= '9')
+          << "Invalid feature: " << string(token.begin, token.end);
+      index = 10 * index + (*p - '0');
+      CHECK_LE(index, INT32_MAX);
+    }
+    CHECK_GE(index, 1) << "Features are one-based";
+    row->push_back(std::make_pair(index - 1, ParseValue(colon + 1, token.end)));
+  }
+  if (!std::is_sorted(row->begin(), row->end())) {
+    std::sort(row->begin(), row->end());
+  }
+  for (size_t k = 1; k < row->size(); ++k) {
+    CHECK_NE((*row)[k - 1].first, (*row)[k].first)
+        << "Repeated feature: " << (*row)[k].first + 1;
   }
   return true;
 }
 
-bool ParseLinePima(const string& line, Example* example) {
-  example->values.clear();
-  vector<string> values;
-  SplitString(line, ',', &values);
-  for (int i = 0; i < values.size(); ++i) {
-    if (i == values.size() - 1) {
-      if (values[i] == "0") {
-        example->label = -1;
-      } else if (values[i] == "1") {
-        example->label = +1;
-      } else {
-        LOG(FATAL) << "Unexpected label: " << values[i];
-      }
-    } else {
-      float value = atof(values[i].c_str());
-      example->values.push_back(value);
+// Parse the lines in [begin, end) of a libsvm data file, and append their
+// examples to examples and their feature values to rows, whose offsets must
+// not be empty. A final line without a trailing newline is ignored.
+static void ParseLibSvmLines(const char* begin, const char* end,
+                             vector<Example>* examples, SparseRows* rows) {
+  vector<pair<Feature, Value>> row;
+  ForEachLine<' '>(begin, end, [&](const vector<Token>& tokens) {
+    Example example;
+    if (!ParseLibSvmTokens(tokens, &example, &row)) return;
+    examples->push_back(std::move(example));
+    for (const pair<Feature, Value>& feature_value : row) {
+      rows->features.push_back(feature_value.first);
+      rows->values.push_back(feature_value.second);
+      rows->num_features =
+          std::max(rows->num_features, feature_value.first + 1);
     }
+    rows->offsets.push_back(rows->features.size());
+  });
+}
+
+void ReadSparseExamples(vector<Example>* examples, SparseRows* rows) {
+  CHECK_EQ(FLAGS_data_set, "libsvm");
+  examples->clear();
+  rows->num_features = 0;
+  rows->offsets.assign(1, 0);
+  rows->features.clear();
+  rows->values.clear();
+  size_t size;
+  const char* data = MapFile(FLAGS_data_filename, &size);
+  const vector<const char*> chunk_begins = SplitIntoChunks(data, size);
+  const int num_chunks = chunk_begins.size() - 1;
+  vector<vector<Example>> chunk_examples(num_chunks);
+  vector<SparseRows> chunk_rows(num_chunks);
+  ParallelFor(num_chunks, [&](int i) {
+    chunk_rows[i].num_features = 0;
+    chunk_rows[i].offsets.assign(1, 0);
+    ParseLibSvmLines(chunk_begins[i], chunk_begins[i + 1], &chunk_examples[i],
+                     &chunk_rows[i]);
+  });
+  for (int i = 0; i < num_chunks; ++i) {
+    std::move(chunk_examples[i].begin(), chunk_examples[i].end(),
+              std::back_inserter(*examples));
+    vector<Example>().swap(chunk_examples[i]);
+    const SparseRows& chunk = chunk_rows[i];
+    const int64_t chunk_begin = rows->features.size();
+    rows->num_features = std::max(rows->num_features, chunk.num_features);
+    rows->features.insert(rows->features.end(), chunk.features.begin(),
+                          chunk.features.end());
+    rows->values.insert(rows->values.end(), chunk.values.begin(),
+                        chunk.values.end());
+    for (size_t j = 1; j < chunk.offsets.size(); ++j) {
+      rows->offsets.push_back(chunk_begin + chunk.offsets[j]);
+    }
+    chunk_rows[i] = SparseRows();
   }
-  return true;
+  UnmapFile(data, size);
 }
 
+void ReadExamples(vector<Example>* examples) {
+  CHECK_NE(FLAGS_data_set, "libsvm")
+      << "libsvm data sets are sparse. Read them with ReadSparseExamples()";
+  examples->clear();
+  if (FLAGS_data_set == "binary") {
+    ReadBinaryExamples(examples);
+  } else {
+    ReadTextExamples(examples);
+  }
+}
 
-void ReadData(vector<Example>* train_examples,
-              vector<Example>* cv_examples,
-              vector<Example>* test_examples) {
-  train_examples->clear();
-  cv_examples->clear();
-  test_examples->clear();
-  vector<Example> examples;
-  std::ifstream file(FLAGS_data_filename);
-  CHECK(file.is_open());
-  string line;
-  while (!std::getline(file, line).eof()) {
-    Example example;
-    bool keep_example;
-    if (FLAGS_data_set == "breastcancer") {
-      keep_example = ParseLineBreastCancer(line, &example);
-    } else if (FLAGS_data_set == "ionosphere") {
-      keep_example = ParseLineIon(line, &example);
-    } else if (FLAGS_data_set == "german") {
-      keep_example = ParseLineGerman(line, &example);
-    } else if (FLAGS_data_set == "ocr17-mnist") {
-      keep_example = ParseLineOcr17(line, &example);
-    } else if (FLAGS_data_set == "ocr49-mnist") {
-      keep_example = ParseLineOcr49(line, &example);
-    } else if (FLAGS_data_set == "ocr17") {
-      keep_example = ParseLineOcr17Princeton(line, &example);
-    } else if (FLAGS_data_set == "ocr49") {
-      keep_example = ParseLineOcr49Princeton(line, &example);
-    } else if (FLAGS_data_set == "diabetes") {
-      keep_example = ParseLinePima(line, &example);
-    } else {
-      LOG(FATAL) << "Unknown data set: " << FLAGS_data_set;
+void WriteBinaryData(const vector<Example>& examples, const string& filename) {
+  BinaryDataHeader header;
+  memcpy(header.magic, kBinaryDataMagic, sizeof(header.magic));
+  header.num_examples = examples.size();
+  header.num_features = examples.empty() ? 0 : examples[0].values.size();
+  header.reserved = 0;
+  std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+  CHECK(file.is_open()) << "Could not open " << filename;
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  vector<int32_t> labels;
+  labels.reserve(examples.size());
+  for (const Example& example : examples) {
+    CHECK_EQ(example.values.size(), header.num_features);
+    CHECK(example.label == -1 || example.label == 1);
+    labels.push_back(example.label);
+  }
+  file.write(reinterpret_cast<const char*>(labels.data()),
+             labels.size() * sizeof(int32_t));
+  vector<float> column(examples.size());
+  for (Feature j = 0; j < header.num_features; ++j) {
+    for (size_t i = 0; i < examples.size(); ++i) {
+      column[i] = examples[i].values[j];
     }
-    if (keep_example) examples.push_back(example);
+    file.write(reinterpret_cast<const char*>(column.data()),
+               column.size() * sizeof(float));
   }
-  std::shuffle(examples.begin(), examples.end(), rng);
+  CHECK(file.good()) << "Could not write " << filename;
+}
+
+// Shuffle num_examples examples and assign them to folds. Sets order[i] to
+// the index before shuffling of the i-th example in shuffled order, folds[i]
+// to its fold, and flip[i] to whether noise flips its label.
+static void AssignFolds(int num_examples, vector<int>* order,
+                        vector<int>* folds, vector<bool>* flip) {
+  order->resize(num_examples);
+  std::iota(order->begin(), order->end(), 0);
+  // Shuffling the indices permutes them exactly as shuffling the examples
+  // themselves would.
+  std::shuffle(order->begin(), order->end(), rng);
+  folds->resize(num_examples);
+  flip->resize(num_examples);
   std::uniform_real_distribution<double> dist;
   int fold = 0;
-  // TODO(usyed): Two loops is inefficient
-  for (Example& example : examples) {
+  for (int i = 0; i < num_examples; ++i) {
     double r = dist(rng);
-    if (r < FLAGS_noise_prob) {
-      example.label = -example.label;
-    }
-    if (fold == FLAGS_fold_to_test) {
-      test_examples->push_back(example);
-    } else if (fold == FLAGS_fold_to_cv) {
-      cv_examples->push_back(example);
-    } else {
-      train_examples->push_back(example);
-    }
+    (*flip)[i] = (r < FLAGS_noise_prob);
+    (*folds)[i] = fold;
     ++fold;
     if (fold == FLAGS_num_folds) fold = 0;
   }
-  const float initial_wgt = 1.0 / train_examples->size();
-  // TODO(usyed): Three loops is _really_ inefficient
-  for (Example& example : *train_examples) {
-    example.weight = initial_wgt;
+}
+
+// Return the set of data_set that examples in fold belong to.
+static ExampleSet* FoldExampleSet(int fold, DataSet* data_set) {
+  if (fold == FLAGS_fold_to_test) {
+    return &data_set->test;
+  } else if (fold == FLAGS_fold_to_cv) {
+    return &data_set->cv;
+  } else {
+    return &data_set->train;
+  }
+}
+
+// Where the examples of a data file go in the sets of a data set. The i-th
+// example of the file is example indices[i] of set sets[i], and its label is
+// flipped by noise if flips[i].
+typedef struct Placement {
+  vector<ExampleSet*> sets;
+  vector<int> indices;
+  vector<bool> flips;
+} Placement;
+
+// Shuffle the num_examples examples of a data file, assign them to folds, and
+// set placement to where they go in data_set. The examples of each set are in
+// shuffled order, except that if train_on_disk, the training examples are in
+// file order. Make the sets of data_set hold room for their examples, with
+// uniform weights. If sparse, the feature values of the sets are stored in
+// sparse rows, whose offsets are all zero, and otherwise in columns of size
+// num_features. If train_on_disk, the training set has no feature values,
+// since they are read from disk during training. The labels and feature
+// values are left to the caller.
+static void PlaceExamples(int num_examples, int num_features, bool sparse,
+                          bool train_on_disk, DataSet* data_set,
+                          Placement* placement) {
+  vector<int> order, folds;
+  vector<bool> flip;
+  AssignFolds(num_examples, &order, &folds, &flip);
+  for (ExampleSet* examples :
+       {&data_set->train, &data_set->cv, &data_set->test}) {
+    *examples = ExampleSet();
+    examples->num_examples = 0;
+    examples->num_features = num_features;
+  }
+  placement->sets.resize(num_examples);
+  placement->indices.resize(num_examples);
+  placement->flips.resize(num_examples);
+  for (int i = 0; i < num_examples; ++i) {
+    ExampleSet* examples = FoldExampleSet(folds[i], data_set);
+    placement->sets[order[i]] = examples;
+    placement->indices[order[i]] = examples->num_examples++;
+    placement->flips[order[i]] = flip[i];
+  }
+  if (train_on_disk) {
+    int k = 0;
+    for (int i = 0; i < num_examples; ++i) {
+      if (placement->sets[i] == &data_set->train) placement->indices[i] = k++;
+    }
+  }
+  for (ExampleSet* examples :
+       {&data_set->train, &data_set->cv, &data_set->test}) {
+    examples->labels.resize(examples->num_examples);
+    examples->weights.assign(examples->num_examples,
+                             1.0 / std::max(examples->num_examples, 1));
+    if (sparse) {
+      examples->sparse_rows.num_features = num_features;
+      examples->sparse_rows.offsets.assign(examples->num_examples + 1, 0);
+    } else if (!train_on_disk || examples != &data_set->train) {
+      examples->values.resize(static_cast<int64_t>(num_features) *
+                              examples->num_examples);
+    }
+  }
+}
+
+// Set the label and feature values of the i-th example of a data file, whose
+// features are the num_features first values of values, in its place in
+// placement.
+static void PlaceExample(const Placement& placement, int i, Label label,
+                         const Value* values, int num_features) {
+  ExampleSet* examples = placement.sets[i];
+  const int k = placement.indices[i];
+  examples->labels[k] = placement.flips[i] ? -label : label;
+  for (Feature j = 0; j < num_features; ++j) {
+    examples->values[static_cast<int64_t>(j) * examples->num_examples + k] =
+        values[j];
+  }
+}
+
+// Read the text data file of data set --data_set straight into the sets of
+// data_set. A first pass over the file counts the examples to keep in each
+// chunk, so that the place of every example is known before it is parsed.
+// Each chunk is then parsed into the sets in parallel.
+static void ReadTextDataSet(DataSet* data_set) {
+  const DataFormat format = GetDataFormat(FLAGS_data_set);
+  const vector<bool> skip = MakeSkipColumns(format);
+  size_t size;
+  const char* data = MapFile(FLAGS_data_filename, &size);
+  const vector<const char*> chunk_begins = SplitIntoChunks(data, size);
+  const int num_chunks = chunk_begins.size() - 1;
+  // Number of examples kept in each chunk, and the number of features of the
+  // first of them, or -1 if there are none.
+  vector<int> chunk_sizes(num_chunks, 0), chunk_num_features(num_chunks, -1);
+  ParallelFor(num_chunks, [&](int c) {
+    Example example;
+    const auto count_line = [&](const vector<Token>& tokens) {
+      if (chunk_num_features[c] == -1) {
+        if (!ParseTokens(tokens, format, skip, &example)) return;
+        chunk_num_features[c] = example.values.size();
+      } else if (!ParseTokens(tokens, format, skip, nullptr)) {
+        return;
+      }
+      ++chunk_sizes[c];
+    };
+    ForEachLine(format.delimiter, chunk_begins[c], chunk_begins[c + 1],
+                count_line);
+  });
+  vector<int> chunk_firsts(num_chunks + 1, 0);
+  int num_features = 0;
+  for (int c = num_chunks - 1; c >= 0; --c) {
+    if (chunk_num_features[c] >= 0) num_features = chunk_num_features[c];
+  }
+  for (int c = 0; c < num_chunks; ++c) {
+    chunk_firsts[c + 1] = chunk_firsts[c] + chunk_sizes[c];
+  }
+  Placement placement;
+  PlaceExamples(chunk_firsts[num_chunks], num_features, false, false, data_set,
+                &placement);
+  ParallelFor(num_chunks, [&](int c) {
+    Example example;
+    int i = chunk_firsts[c];
+    const auto parse_line = [&](const vector<Token>& tokens) {
+      if (!ParseTokens(tokens, format, skip, &example)) return;
+      CHECK_EQ(example.values.size(), num_features);
+      PlaceExample(placement, i++, example.label, example.values.data(),
+                   num_features);
+    };
+    ForEachLine(format.delimiter, chunk_begins[c], chunk_begins[c + 1],
+                parse_line);
+    CHECK_EQ(i, chunk_firsts[c + 1]);
+  });
+  UnmapFile(data, size);
+}
+
+// Copy the examples of a binary data file, mapped into memory with
+// MapBinaryData(), into their places in placement. Training examples are
+// skipped if train is not null.
+static void CopyBinaryExamples(const BinaryDataHeader& header,
+                               const int32_t* labels, const float* columns,
+                               const Placement& placement,
+                               const ExampleSet* train) {
+  const int64_t num_examples = header.num_examples;
+  const int num_features = header.num_features;
+  const int num_chunks = (num_examples + kBinaryChunkSize - 1) /
+                         kBinaryChunkSize;
+  ParallelFor(num_chunks, [&](int chunk) {
+    const int64_t begin = chunk * kBinaryChunkSize;
+    const int64_t end = std::min(begin + kBinaryChunkSize, num_examples);
+    vector<Value> values(num_features);
+    for (int64_t i = begin; i < end; ++i) {
+      if (placement.sets[i] == train) continue;
+      for (Feature j = 0; j < num_features; ++j) {
+        values[j] = columns[j * num_examples + i];
+      }
+      PlaceExample(placement, i, labels[i], values.data(), num_features);
+    }
+  });
+}
+
+// Read the binary data file --data_filename straight into the sets of
+// data_set.
+static void ReadBinaryDataSet(DataSet* data_set) {
+  size_t size;
+  BinaryDataHeader header;
+  const int32_t* labels;
+  const float* columns;
+  const char* data = MapBinaryData(FLAGS_data_filename, &size, &header,
+                                   &labels, &columns);
+  Placement placement;
+  PlaceExamples(header.num_examples, header.num_features, false, false,
+                data_set, &placement);
+  CopyBinaryExamples(header, labels, columns, placement, nullptr);
+  UnmapFile(data, size);
+}
+
+// Read the libsvm data file --data_filename straight into the sparse rows of
+// the sets of data_set. As in ReadTextDataSet(), a first pass counts the
+// examples of each chunk, and also the number of stored values of each
+// example, so that the offsets of the rows of each set are known before the
+// examples are parsed.
+static void ReadLibSvmDataSet(DataSet* data_set) {
+  size_t size;
+  const char* data = MapFile(FLAGS_data_filename, &size);
+  const vector<const char*> chunk_begins = SplitIntoChunks(data, size);
+  const int num_chunks = chunk_begins.size() - 1;
+  // Number of stored values of each example of each chunk.
+  vector<vector<int>> chunk_row_sizes(num_chunks);
+  ParallelFor(num_chunks, [&](int c) {
+    const auto count_line = [&](const vector<Token>& tokens) {
+      if (tokens.empty()) return;  // Blank line
+      chunk_row_sizes[c].push_back(tokens.size() - 1);
+    };
+    ForEachLine<' '>(chunk_begins[c], chunk_begins[c + 1], count_line);
+  });
+  vector<int> chunk_firsts(num_chunks + 1, 0);
+  for (int c = 0; c < num_chunks; ++c) {
+    chunk_firsts[c + 1] = chunk_firsts[c] + chunk_row_sizes[c].size();
+  }
+  Placement placement;
+  PlaceExamples(chunk_firsts[num_chunks], 0, true, false, data_set,
+                &placement);
+  for (int c = 0; c < num_chunks; ++c) {
+    for (size_t k = 0; k < chunk_row_sizes[c].size(); ++k) {
+      const int i = chunk_firsts[c] + k;
+      placement.sets[i]->sparse_rows.offsets[placement.indices[i] + 1] =
+          chunk_row_sizes[c][k];
+    }
+    vector<int>().swap(chunk_row_sizes[c]);
+  }
+  for (ExampleSet* examples :
+       {&data_set->train, &data_set->cv, &data_set->test}) {
+    SparseRows& rows = examples->sparse_rows;
+    std::partial_sum(rows.offsets.begin(), rows.offsets.end(),
+                     rows.offsets.begin());
+    rows.features.resize(rows.offsets.back());
+    rows.values.resize(rows.offsets.back());
+  }
+  vector<int> chunk_num_features(num_chunks, 0);
+  ParallelFor(num_chunks, [&](int c) {
+    vector<pair<Feature, Value>> row;
+    Example example;
+    int i = chunk_firsts[c];
+    const auto parse_line = [&](const vector<Token>& tokens) {
+      if (!ParseLibSvmTokens(tokens, &example, &row)) return;
+      ExampleSet* examples = placement.sets[i];
+      const int k = placement.indices[i];
+      examples->labels[k] =
+          placement.flips[i] ? -example.label : example.label;
+      SparseRows& rows = examples->sparse_rows;
+      CHECK_EQ(rows.offsets[k + 1] - rows.offsets[k], row.size());
+      int64_t offset = rows.offsets[k];
+      for (const pair<Feature, Value>& feature_value : row) {
+        rows.features[offset] = feature_value.first;
+        rows.values[offset] = feature_value.second;
+        ++offset;
+        chunk_num_features[c] =
+            std::max(chunk_num_features[c], feature_value.first + 1);
+      }
+      ++i;
+    };
+    ForEachLine<' '>(chunk_begins[c], chunk_begins[c + 1], parse_line);
+  });
+  const int num_features =
+      *std::max_element(chunk_num_features.begin(), chunk_num_features.end());
+  for (ExampleSet* examples :
+       {&data_set->train, &data_set->cv, &data_set->test}) {
+    examples->num_features = num_features;
+    examples->sparse_rows.num_features = num_features;
+  }
+  UnmapFile(data, size);
+}
+
+void ReadDataSet(DataSet* data_set) {
+  if (FLAGS_data_set == "libsvm") {
+    ReadLibSvmDataSet(data_set);
+  } else if (FLAGS_data_set == "binary") {
+    ReadBinaryDataSet(data_set);
+  } else {
+    ReadTextDataSet(data_set);
+  }
+}
+
+void ReadDataSetOnDisk(DataSet* data_set, DiskColumns* train_columns) {
+  CHECK_EQ(FLAGS_data_set, "binary");
+  size_t size;
+  BinaryDataHeader header;
+  const int32_t* labels;
+  const float* columns;
+  // The file stays mapped, since train_columns points into it.
+  MapBinaryData(FLAGS_data_filename, &size, &header, &labels, &columns);
+  const int64_t num_examples = header.num_examples;
+  Placement placement;
+  PlaceExamples(num_examples, header.num_features, false, true, data_set,
+                &placement);
+  // Training examples are kept in file order, so that their columns are read
+  // sequentially. They have no feature values.
+  ExampleSet& train = data_set->train;
+  train_columns->values = columns;
+  train_columns->num_file_rows = num_examples;
+  train_columns->num_features = header.num_features;
+  train_columns->rows.resize(train.num_examples);
+  for (int i = 0; i < num_examples; ++i) {
+    if (placement.sets[i] != &train) continue;
+    const int k = placement.indices[i];
+    train.labels[k] = placement.flips[i] ? -labels[i] : labels[i];
+    train_columns->rows[k] = i;
   }
-  return;
+  // Cross-validation and test examples are in shuffled order, and their
+  // feature values are copied into their sets.
+  CopyBinaryExamples(header, labels, columns, placement, &train);
 }
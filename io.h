@@ -27,29 +27,69 @@ using std::string;
 // delimiters are ignored.
 void SplitString(const string &text, char sep, vector<string>* tokens);
 
-void SetSeed(uint_fast32_t seed);
-
-// The following functions each parse one line of a data set.
-
-bool ParseLineBreastCancer(const string& line, Example* example);
-
-bool ParseLineIon(const string& line, Example* example);
-
-bool ParseLineGerman(const string& line, Example* example);
+// Parse the number in [begin, end), which need not be null-terminated.
+// Returns the same value as atof() on a null-terminated copy of the text, but
+// does not depend on the locale and does not copy plain decimal numbers.
+Value ParseValue(const char* begin, const char* end);
 
-bool ParseLineOcr49(const string& line, Example* example);
-
-bool ParseLineOcr17(const string& line, Example* example);
-
-bool ParseLineOcr49Princeton(const string& line, Example* example);
-
-bool ParseLineOcr17Princeton(const string& line, Example* example);
-
-bool ParseLinePima(const string& line, Example* example);
+void SetSeed(uint_fast32_t seed);
 
-// Read data set into training set, cross-validation set and test set.
-void ReadData(vector<Example>* train_examples,
-              vector<Example>* cv_examples,
-              vector<Example>* test_examples);
+// Describes the lines of a text data set. Each line is one example, whose
+// columns are separated by delimiter. Consecutive delimiters are ignored. The
+// label column is mapped to -1 or +1, and all other columns that are not
+// skipped are features, in column order.
+typedef struct DataFormat {
+  char delimiter;
+  vector<int> skip_columns;  // Zero-indexed
+  int label_column;  // Zero-indexed, or -1 for the last column
+  vector<string> negative_labels;  // Labels mapped to -1
+  vector<string> positive_labels;  // Labels mapped to +1
+  bool drop_unknown_labels;  // If false, an unknown label is fatal
+  string missing_value;  // If not empty, drop examples with a missing feature
+} DataFormat;
+
+// Return the format of the text data set named data_set. The format of data
+// set custom is given by the custom_* flags.
+DataFormat GetDataFormat(const string& data_set);
+
+// Parse one line of a data set with format into example. Returns false if the
+// example should be dropped.
+bool ParseLine(const string& line, const DataFormat& format, Example* example);
+
+// Read all examples of data set --data_set from --data_filename, in file order.
+// The data set must not be sparse.
+void ReadExamples(vector<Example>* examples);
+
+// Read all examples of the sparse data set --data_filename, in libsvm format
+// (--data_set=libsvm), in file order. Each line is a label followed by
+// feature:value pairs, where features are one-based and missing features are
+// zero. Labels greater than zero are positive, and others are negative. The
+// examples have no values. Instead, row i of rows holds the feature values of
+// examples[i].
+void ReadSparseExamples(vector<Example>* examples, SparseRows* rows);
+
+// Write examples to filename in the binary format that ReadExamples() reads
+// when --data_set is binary. The format stores labels and feature values in
+// columns, so it is much faster to load than the text formats.
+void WriteBinaryData(const vector<Example>& examples, const string& filename);
+
+// Read data set --data_set into data_set, in shuffled order, and split it
+// into training, cross-validation and test sets. The examples of each set get
+// uniform weights. For a sparse data set (--data_set=libsvm), the feature
+// values of each set are in its sparse rows, and otherwise they are in its
+// columns. The examples are parsed straight into their sets, so the data set
+// is only held in memory once.
+void ReadDataSet(DataSet* data_set);
+
+// Like ReadDataSet(), but for a binary data file (--data_set=binary) whose
+// feature values should stay on disk while training. Training examples are
+// kept in file order, and have labels and weights but no feature values.
+// Their feature values are given by train_columns, which points into the
+// file. The file stays mapped into memory. Cross-validation and test examples
+// are read as in ReadDataSet(). The training set has the same examples as with
+// ReadDataSet(), but in a different order, so the weights of each node are
+// summed in a different order. Models trained on it are therefore only equal
+// to those trained in memory up to floating-point summation order.
+void ReadDataSetOnDisk(DataSet* data_set, DiskColumns* train_columns);
 
 #endif  // IO_H_
@@ -16,6 +16,10 @@ limitations under the License.
 
 #include "srm_test.h"
 #include "io.h"
+#include "tree.h"
+
+#include <cmath>
+#include <cstdio>
 
 #include "gflags/gflags.h"
 #include "gtest/gtest.h"
@@ -26,6 +30,9 @@ DECLARE_int32(fold_to_cv);
 DECLARE_int32(fold_to_test);
 DECLARE_int32(num_folds);
 DECLARE_double(noise_prob);
+DECLARE_string(custom_negative_labels);
+DECLARE_string(custom_positive_labels);
+DECLARE_int32(custom_label_column);
 
 class IoTest : public SrmTest {};
 
@@ -48,10 +55,30 @@ TEST_F(IoTest, SplitStringTest) {
   EXPECT_EQ("1", tokens[3]);
 }
 
+TEST_F(IoTest, ParseValueTest) {
+  const vector<string> texts = {
+      "0", "-0", "5", "+17", "0.83443", "-0.15899", ".5", "5.", "1e3",
+      "2.5E-3", "-1e+22", "3.4028235e38", "1e-45", "123456789012345678901",
+      "0.1000000000000000055511151231257827", "1e", "1e+", "-", ".", "abc",
+      "12abc", " 7", "7\r", "inf", "-nan", "0x1p3", "1e99999999999999999999",
+      "1e-99999999999999999999", "0.0001e-99999999999"};
+  for (const string& text : texts) {
+    const float expected = atof(text.c_str());
+    const float value = ParseValue(text.data(), text.data() + text.size());
+    if (std::isnan(expected)) {
+      EXPECT_TRUE(std::isnan(value)) << text;
+    } else {
+      EXPECT_EQ(expected, value) << text;
+      EXPECT_EQ(std::signbit(expected), std::signbit(value)) << text;
+    }
+  }
+}
+
 TEST_F(IoTest, ParseLineBreastCancerTest) {
+  const DataFormat format = GetDataFormat("breastcancer");
   Example example;
   string line = "1000025,5,1,1,1,2,1,3,1,1,2";
-  EXPECT_TRUE(ParseLineBreastCancer(line, &example));
+  EXPECT_TRUE(ParseLine(line, format, &example));
   EXPECT_EQ(-1, example.label);
   EXPECT_EQ(9, example.values.size());
   // Spot check features
@@ -59,19 +86,20 @@ TEST_F(IoTest, ParseLineBreastCancerTest) {
   EXPECT_NEAR(3, example.values[6], kTolerance);
   EXPECT_NEAR(1, example.values[8], kTolerance);
   line = "1017122,8,10,10,8,7,10,9,7,1,4";
-  EXPECT_TRUE(ParseLineBreastCancer(line, &example));
+  EXPECT_TRUE(ParseLine(line, format, &example));
   EXPECT_EQ(1, example.label);
   line = "1057013,8,4,5,1,2,?,7,3,1,4";
-  EXPECT_FALSE(ParseLineBreastCancer(line, &example));
+  EXPECT_FALSE(ParseLine(line, format, &example));
 }
 
 TEST_F(IoTest, ParseLineIonTest) {
+  const DataFormat format = GetDataFormat("ionosphere");
   Example example;
   string line =
       "1,0,1,-0.15899,0.72314,0.27686,0.83443,-0.58388,1,-0.28207,1,-0.49863,0."
       "79962,-0.12527,0.76837,0.14638,1,0.39337,1,0.26590,0.96354,-0.01891,0."
       "92599,-0.91338,1,0.14803,1,-0.11582,1,-0.11129,1,0.53372,1,-0.57758,g";
-  EXPECT_TRUE(ParseLineIon(line, &example));
+  EXPECT_TRUE(ParseLine(line, format, &example));
   EXPECT_EQ(1, example.label);
   EXPECT_EQ(34, example.values.size());
   // Spot check features
@@ -83,22 +111,23 @@ TEST_F(IoTest, ParseLineIonTest) {
       "67743,0.34432,-0.69707,-0.51685,-0.97515,0.05499,-0.62237,0.33109,-1,-0."
       "13151,-0.45300,-0.18056,-0.35734,-0.20332,-0.26569,-0.20468,-0.18401,-0."
       "19040,-0.11593,-0.16626,-0.06288,-0.13738,-0.02447,b";
-  EXPECT_TRUE(ParseLineIon(line, &example));
+  EXPECT_TRUE(ParseLine(line, format, &example));
   EXPECT_EQ(-1, example.label);
 }
 
 TEST_F(IoTest, ParseLineGermanTest) {
+  const DataFormat format = GetDataFormat("german");
   Example example;
   string line =
       "   2  48   2  60   1   3   2   2   1  22   3   1   1   1   1   0   0   "
       "1   0   0   1   0   0   1   2 ";
-  EXPECT_TRUE(ParseLineGerman(line, &example));
+  EXPECT_TRUE(ParseLine(line, format, &example));
   EXPECT_EQ(1, example.label);
   EXPECT_EQ(24, example.values.size());
   line =
       "   1   6   4  12   5   5   3   4   1  67   3   2   1   2   1   0   0   "
       "1   0   0   1   0   0   1   1 ";
-  EXPECT_TRUE(ParseLineGerman(line, &example));
+  EXPECT_TRUE(ParseLine(line, format, &example));
   EXPECT_EQ(-1, example.label);
   // Spot check features
   EXPECT_NEAR(1, example.values[0], kTolerance);
@@ -108,19 +137,20 @@ TEST_F(IoTest, ParseLineGermanTest) {
 }
 
 TEST_F(IoTest, ParseLineOcr17Test) {
+  const DataFormat format = GetDataFormat("ocr17-mnist");
   Example example;
   string line =
       "0,0,0,3,16,11,1,0,0,0,0,8,16,16,1,0,0,0,0,9,16,14,0,0,0,1,7,16,16,11,0,"
       "0,0,9,16,16,16,8,0,0,0,1,8,6,16,7,0,0,0,0,0,5,16,9,0,0,0,0,0,2,14,14,1,"
       "0,1";
-  EXPECT_TRUE(ParseLineOcr17(line, &example));
+  EXPECT_TRUE(ParseLine(line, format, &example));
   EXPECT_EQ(-1, example.label);
   EXPECT_EQ(64, example.values.size());
   line =
       "0,0,8,15,16,13,0,0,0,1,11,9,11,16,1,0,0,0,0,0,7,14,0,0,0,0,3,4,14,12,2,"
       "0,0,1,16,16,16,16,10,0,0,2,12,16,10,0,0,0,0,0,2,16,4,0,0,0,0,0,9,14,0,0,"
       "0,0,7";
-  EXPECT_TRUE(ParseLineOcr17(line, &example));
+  EXPECT_TRUE(ParseLine(line, format, &example));
   EXPECT_EQ(1, example.label);
   // Spot check features
   EXPECT_NEAR(0, example.values[0], kTolerance);
@@ -131,16 +161,17 @@ TEST_F(IoTest, ParseLineOcr17Test) {
       "0,0,0,3,11,16,0,0,0,0,5,16,11,13,7,0,0,3,15,8,1,15,6,0,0,11,16,16,16,16,"
       "10,0,0,1,4,4,13,10,2,0,0,0,0,0,15,4,0,0,0,0,0,3,16,0,0,0,0,0,0,1,15,2,0,"
       "0,4";
-  EXPECT_FALSE(ParseLineOcr17(line, &example));
+  EXPECT_FALSE(ParseLine(line, format, &example));
 }
 
 TEST_F(IoTest, ParseLineOcr49Test) {
+  const DataFormat format = GetDataFormat("ocr49-mnist");
   Example example;
   string line =
       "0,0,0,3,11,16,0,0,0,0,5,16,11,13,7,0,0,3,15,8,1,15,6,0,0,11,16,16,16,16,"
       "10,0,0,1,4,4,13,10,2,0,0,0,0,0,15,4,0,0,0,0,0,3,16,0,0,0,0,0,0,1,15,2,0,"
       "0,4";
-  EXPECT_TRUE(ParseLineOcr49(line, &example));
+  EXPECT_TRUE(ParseLine(line, format, &example));
   EXPECT_EQ(-1, example.label);
   // Spot check features
   EXPECT_NEAR(0, example.values[0], kTolerance);
@@ -153,16 +184,17 @@ TEST_F(IoTest, ParseLineOcr49Test) {
       "0,0,0,4,13,16,16,3,0,0,8,16,9,12,16,4,0,7,16,3,3,15,13,0,0,9,15,14,16,"
       "16,6,0,0,1,8,7,12,15,0,0,0,0,0,0,13,10,0,0,0,0,0,3,15,6,0,0,0,0,0,5,15,"
       "4,0,0,9";
-  EXPECT_TRUE(ParseLineOcr49(line, &example));
+  EXPECT_TRUE(ParseLine(line, format, &example));
   EXPECT_EQ(1, example.label);
   line =
       "0,0,8,15,16,13,0,0,0,1,11,9,11,16,1,0,0,0,0,0,7,14,0,0,0,0,3,4,14,12,2,"
       "0,0,1,16,16,16,16,10,0,0,2,12,16,10,0,0,0,0,0,2,16,4,0,0,0,0,0,9,14,0,0,"
       "0,0,7";
-  EXPECT_FALSE(ParseLineOcr49(line, &example));
+  EXPECT_FALSE(ParseLine(line, format, &example));
 }
 
 TEST_F(IoTest, ParseLineOcr17PrincetonTest) {
+  const DataFormat format = GetDataFormat("ocr17");
   Example example;
   string line =
       "0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 "
@@ -171,7 +203,7 @@ TEST_F(IoTest, ParseLineOcr17PrincetonTest) {
       "0 0 0 0 0 0 0 0 0 0 2 3 0 0 0 0 0 0 0 0 0 0 0 1 3 0 0 0 0 0 0 0 0 0 0 0 "
       "0 3 1 0 0 0 0 0 0 0 0 0 0 0 2 2 0 0 0 0 0 0 0 0 0 0 0 1 3 0 0 0 0 0 0 0 "
       "0 0 0 0 0 0 1 0 0 0 0 0 0 0 0 0 7";
-  EXPECT_TRUE(ParseLineOcr17Princeton(line, &example));
+  EXPECT_TRUE(ParseLine(line, format, &example));
   EXPECT_EQ(1, example.label);
   EXPECT_EQ(196, example.values.size());
   line =
@@ -181,7 +213,7 @@ TEST_F(IoTest, ParseLineOcr17PrincetonTest) {
       "0 0 0 0 0 0 0 0 0 0 3 3 0 0 0 0 0 0 0 0 0 0 0 0 3 2 0 0 0 0 0 0 0 0 0 0 "
       "0 0 3 2 0 0 0 0 0 0 0 0 0 0 0 0 3 1 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 "
       "0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 1";
-  EXPECT_TRUE(ParseLineOcr17Princeton(line, &example));
+  EXPECT_TRUE(ParseLine(line, format, &example));
   EXPECT_EQ(-1, example.label);
   // Spot check features
   EXPECT_NEAR(0, example.values[0], kTolerance);
@@ -195,10 +227,11 @@ TEST_F(IoTest, ParseLineOcr17PrincetonTest) {
       "0 0 0 0 0 0 0 0 0 0 3 3 0 0 0 0 0 0 0 0 0 0 0 0 3 2 0 0 0 0 0 0 0 0 0 0 "
       "0 0 3 2 0 0 0 0 0 0 0 0 0 0 0 0 3 1 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 "
       "0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 4";
-  EXPECT_FALSE(ParseLineOcr17Princeton(line, &example));
+  EXPECT_FALSE(ParseLine(line, format, &example));
 }
 
 TEST_F(IoTest, ParseLineOcr49PrincetonTest) {
+  const DataFormat format = GetDataFormat("ocr49");
   Example example;
   string line =
       "0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 "
@@ -207,7 +240,7 @@ TEST_F(IoTest, ParseLineOcr49PrincetonTest) {
       "0 0 0 0 0 0 0 0 0 0 1 3 3 0 0 0 0 0 0 0 0 0 0 0 1 3 1 0 0 0 0 0 0 0 0 0 "
       "0 0 2 3 0 0 0 0 0 0 0 0 0 0 0 0 3 1 0 0 0 0 0 0 0 0 0 0 0 2 3 0 0 0 0 0 "
       "0 0 0 0 0 0 0 0 1 0 0 0 0 0 0 0 9";
-  EXPECT_TRUE(ParseLineOcr49Princeton(line, &example));
+  EXPECT_TRUE(ParseLine(line, format, &example));
   EXPECT_EQ(1, example.label);
   EXPECT_EQ(196, example.values.size());
   line =
@@ -217,7 +250,7 @@ TEST_F(IoTest, ParseLineOcr49PrincetonTest) {
       "3 2 0 0 0 0 0 2 2 3 3 3 1 0 0 0 0 0 0 0 0 0 0 3 2 0 0 0 0 0 0 0 0 0 0 0 "
       "0 3 1 0 0 0 0 0 0 0 0 0 0 0 0 1 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 "
       "0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 4";
-  EXPECT_TRUE(ParseLineOcr49Princeton(line, &example));
+  EXPECT_TRUE(ParseLine(line, format, &example));
   EXPECT_EQ(-1, example.label);
   // Spot check features
   EXPECT_NEAR(0, example.values[0], kTolerance);
@@ -232,41 +265,216 @@ TEST_F(IoTest, ParseLineOcr49PrincetonTest) {
       "3 2 0 0 0 0 0 2 2 3 3 3 1 0 0 0 0 0 0 0 0 0 0 3 2 0 0 0 0 0 0 0 0 0 0 0 "
       "0 3 1 0 0 0 0 0 0 0 0 0 0 0 0 1 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 "
       "0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 7";
-  EXPECT_FALSE(ParseLineOcr49Princeton(line, &example));
+  EXPECT_FALSE(ParseLine(line, format, &example));
 }
 
 TEST_F(IoTest, ParseLinePimaTest) {
+  const DataFormat format = GetDataFormat("diabetes");
   Example example;
   string line = "6,148,72,35,0,33.6,0.627,50,1";
-  EXPECT_TRUE(ParseLinePima(line, &example));
+  EXPECT_TRUE(ParseLine(line, format, &example));
   EXPECT_EQ(1, example.label);
   EXPECT_EQ(8, example.values.size());
   // Spot check features
   EXPECT_NEAR(6, example.values[0], kTolerance);
   EXPECT_NEAR(0.627, example.values[6], kTolerance);
   line = "1,85,66,29,0,26.6,0.351,31,0";
-  EXPECT_TRUE(ParseLinePima(line, &example));
+  EXPECT_TRUE(ParseLine(line, format, &example));
+  EXPECT_EQ(-1, example.label);
+}
+
+TEST_F(IoTest, ParseLineCustomFormatTest) {
+  DataFormat format;
+  format.delimiter = '\t';
+  format.skip_columns = {0, 3};
+  format.label_column = 1;
+  format.negative_labels = {"no", "n"};
+  format.positive_labels = {"yes"};
+  format.drop_unknown_labels = true;
+  format.missing_value = "NA";
+  Example example;
+  string line = "17\tn\t1.5\tfoo\t-2\t\t3e2";
+  EXPECT_TRUE(ParseLine(line, format, &example));
   EXPECT_EQ(-1, example.label);
+  vector<Value> values = {1.5, -2, 300};
+  EXPECT_EQ(values, example.values);
+  line = "18\tyes\t2\tNA\t4\t5";  // Skipped column may be missing.
+  EXPECT_TRUE(ParseLine(line, format, &example));
+  EXPECT_EQ(1, example.label);
+  line = "19\tyes\tNA\tbar\t4\t5";
+  EXPECT_FALSE(ParseLine(line, format, &example));
+  line = "20\tmaybe\t2\tbar\t4\t5";
+  EXPECT_FALSE(ParseLine(line, format, &example));
+  EXPECT_FALSE(ParseLine("", format, &example));
+}
+
+TEST_F(IoTest, ReadDataSetTest) {
+  FLAGS_data_set = "breastcancer";
+  FLAGS_data_filename = "./testdata/breast-cancer-wisconsin.data";
+  FLAGS_num_folds = 4;
+  FLAGS_fold_to_cv = 1;
+  FLAGS_fold_to_test = 0;
+  SetSeed(123456);
+
+  DataSet data_set;
+  ReadDataSet(&data_set);
+  EXPECT_EQ(2, data_set.train.num_examples);
+  EXPECT_EQ(1, data_set.cv.num_examples);
+  EXPECT_EQ(1, data_set.test.num_examples);
+  for (const ExampleSet* examples :
+       {&data_set.train, &data_set.cv, &data_set.test}) {
+    EXPECT_EQ(9, examples->num_features);
+    EXPECT_EQ(examples->num_examples, examples->labels.size());
+    EXPECT_EQ(examples->num_examples * 9, examples->values.size());
+    EXPECT_TRUE(examples->sparse_rows.offsets.empty());
+  }
+  EXPECT_NEAR(0.5, data_set.train.weights[0], kTolerance);
+  EXPECT_NEAR(0.5, data_set.train.weights[1], kTolerance);
 }
 
-TEST_F(IoTest, ReadDataTest) {
+TEST_F(IoTest, ReadDataSetBinaryTest) {
   FLAGS_data_set = "breastcancer";
   FLAGS_data_filename = "./testdata/breast-cancer-wisconsin.data";
   FLAGS_num_folds = 4;
   FLAGS_fold_to_cv = 1;
   FLAGS_fold_to_test = 0;
+  FLAGS_noise_prob = 0;
+  vector<Example> examples;
+  ReadExamples(&examples);
+  const string binary_filename = "./io_test_binary.data";
+  WriteBinaryData(examples, binary_filename);
+
+  FLAGS_data_filename = binary_filename;
+  FLAGS_data_set = "binary";
+  vector<Example> binary_examples;
+  ReadExamples(&binary_examples);
+  ASSERT_EQ(examples.size(), binary_examples.size());
+  for (size_t i = 0; i < examples.size(); ++i) {
+    EXPECT_EQ(examples[i].label, binary_examples[i].label);
+    EXPECT_EQ(examples[i].values, binary_examples[i].values);
+  }
+
+  // Same folds as the text file.
+  DataSet binary_data_set;
+  SetSeed(123456);
+  ReadDataSet(&binary_data_set);
+  // Same folds when the training examples stay on disk.
+  DataSet disk_data_set;
+  DiskColumns train_columns;
+  SetSeed(123456);
+  ReadDataSetOnDisk(&disk_data_set, &train_columns);
+  FLAGS_data_set = "breastcancer";
+  FLAGS_data_filename = "./testdata/breast-cancer-wisconsin.data";
+  DataSet data_set;
   SetSeed(123456);
+  ReadDataSet(&data_set);
+  EXPECT_EQ(data_set.train.labels, binary_data_set.train.labels);
+  EXPECT_EQ(data_set.train.values, binary_data_set.train.values);
+  EXPECT_EQ(data_set.cv.labels, binary_data_set.cv.labels);
+  EXPECT_EQ(data_set.cv.values, binary_data_set.cv.values);
+  EXPECT_EQ(data_set.test.labels, binary_data_set.test.labels);
+  EXPECT_EQ(data_set.test.values, binary_data_set.test.values);
+
+  const ExampleSet& disk_train = disk_data_set.train;
+  ASSERT_EQ(data_set.train.num_examples, disk_train.num_examples);
+  ASSERT_EQ(data_set.train.num_examples, train_columns.rows.size());
+  EXPECT_EQ(examples.size(), train_columns.num_file_rows);
+  EXPECT_EQ(examples[0].values.size(), train_columns.num_features);
+  EXPECT_EQ(examples[0].values.size(), disk_train.num_features);
+  EXPECT_TRUE(disk_train.values.empty());
+  for (size_t i = 0; i < train_columns.rows.size(); ++i) {
+    const Example& file_example = examples[train_columns.rows[i]];
+    EXPECT_EQ(file_example.label, disk_train.labels[i]);
+    EXPECT_NEAR(0.5, disk_train.weights[i], kTolerance);
+    for (Feature j = 0; j < train_columns.num_features; ++j) {
+      EXPECT_EQ(file_example.values[j],
+                train_columns.values[j * train_columns.num_file_rows +
+                                     train_columns.rows[i]]);
+    }
+  }
+  ASSERT_EQ(1, disk_data_set.test.num_examples);
+  EXPECT_EQ(data_set.test.labels, disk_data_set.test.labels);
+  EXPECT_EQ(data_set.test.values, disk_data_set.test.values);
+  ASSERT_EQ(1, disk_data_set.cv.num_examples);
+  EXPECT_EQ(data_set.cv.labels, disk_data_set.cv.labels);
+  EXPECT_EQ(data_set.cv.values, disk_data_set.cv.values);
+  std::remove(binary_filename.c_str());
+}
 
-  vector<Example> train_examples, cv_examples, test_examples;
-  ReadData(&train_examples, &cv_examples, &test_examples);
-  EXPECT_EQ(2, train_examples.size());
-  EXPECT_EQ(1, cv_examples.size());
-  EXPECT_EQ(1, test_examples.size());
-  EXPECT_NEAR(0.5, train_examples[0].weight, kTolerance);
-  EXPECT_NEAR(0.5, train_examples[1].weight, kTolerance);
+TEST_F(IoTest, ReadDataSetLibSvmTest) {
+  // The same data in libsvm format and as a dense custom data set.
+  const string libsvm_filename = "./io_test_libsvm.data";
+  const string dense_filename = "./io_test_dense.data";
+  FILE* file = fopen(libsvm_filename.c_str(), "w");
+  fputs("+1 1:0.5 3:2\n-1\n0 2:-1.5 1:7\n1 4:1e1\n-1 3:3\n", file);
+  fclose(file);
+  file = fopen(dense_filename.c_str(), "w");
+  fputs("1,0.5,0,2,0\n-1,0,0,0,0\n0,7,-1.5,0,0\n1,0,0,0,1e1\n-1,0,0,3,0\n",
+        file);
+  fclose(file);
+  FLAGS_data_set = "libsvm";
+  FLAGS_data_filename = libsvm_filename;
+  FLAGS_num_folds = 5;
+  FLAGS_fold_to_cv = 1;
+  FLAGS_fold_to_test = 0;
+  FLAGS_noise_prob = 0;
+
+  vector<Example> examples;
+  SparseRows rows;
+  ReadSparseExamples(&examples, &rows);
+  ASSERT_EQ(5, examples.size());
+  EXPECT_EQ(4, rows.num_features);
+  vector<int64_t> offsets = {0, 2, 2, 4, 5, 6};
+  EXPECT_EQ(offsets, rows.offsets);
+  vector<Feature> features = {0, 2, 0, 1, 3, 2};
+  EXPECT_EQ(features, rows.features);
+  vector<Value> values = {0.5, 2, 7, -1.5, 10, 3};
+  EXPECT_EQ(values, rows.values);
+  vector<Label> labels = {1, -1, -1, 1, -1};
+  for (size_t i = 0; i < examples.size(); ++i) {
+    EXPECT_EQ(labels[i], examples[i].label);
+    EXPECT_TRUE(examples[i].values.empty());
+  }
+
+  // Same folds and values as the dense data set.
+  DataSet data_set;
+  SetSeed(123456);
+  ReadDataSet(&data_set);
+  FLAGS_data_set = "custom";
+  FLAGS_data_filename = dense_filename;
+  FLAGS_custom_label_column = 0;
+  FLAGS_custom_negative_labels = "-1,0";
+  FLAGS_custom_positive_labels = "1";
+  DataSet dense_data_set;
+  SetSeed(123456);
+  ReadDataSet(&dense_data_set);
+  const ExampleSet* sets[] = {&data_set.train, &data_set.cv, &data_set.test};
+  const ExampleSet* dense_sets[] = {&dense_data_set.train, &dense_data_set.cv,
+                                    &dense_data_set.test};
+  for (int k = 0; k < 3; ++k) {
+    const ExampleSet& examples = *sets[k];
+    const ExampleSet& dense_examples = *dense_sets[k];
+    EXPECT_TRUE(dense_examples.sparse_rows.offsets.empty());
+    EXPECT_TRUE(examples.values.empty());
+    ASSERT_EQ(dense_examples.num_examples, examples.num_examples);
+    ASSERT_EQ(dense_examples.num_features, examples.num_features);
+    EXPECT_EQ(dense_examples.labels, examples.labels);
+    EXPECT_EQ(dense_examples.weights, examples.weights);
+    for (int i = 0; i < examples.num_examples; ++i) {
+      for (Feature j = 0; j < examples.num_features; ++j) {
+        EXPECT_EQ(ExampleValue(dense_examples, i, j),
+                  ExampleValue(examples, i, j));
+      }
+    }
+  }
+  FLAGS_custom_label_column = -1;
+  FLAGS_custom_negative_labels = "";
+  FLAGS_custom_positive_labels = "";
+  std::remove(libsvm_filename.c_str());
+  std::remove(dense_filename.c_str());
 }
 
-TEST_F(IoTest, ReadDataTestWithNoise) {
+TEST_F(IoTest, ReadDataSetTestWithNoise) {
   FLAGS_data_set = "breastcancer";
   FLAGS_data_filename = "./testdata/breast-cancer-wisconsin.data";
   FLAGS_num_folds = 4;
@@ -275,29 +483,35 @@ TEST_F(IoTest, ReadDataTestWithNoise) {
   FLAGS_noise_prob = 0;
   SetSeed(123456);
 
-  vector<Example> train_examples, cv_examples, test_examples;
-  ReadData(&train_examples, &cv_examples, &test_examples);
-  Label train_label_0 = train_examples[0].label;
-  Label train_label_1 = train_examples[1].label;
-  Label cv_label_0 = cv_examples[0].label;
-  Label test_label_0 = test_examples[0].label;
+  DataSet data_set;
+  ReadDataSet(&data_set);
+  // Labels of all examples of the data set.
+  auto all_labels = [&data_set]() {
+    vector<Label> labels;
+    for (const ExampleSet* examples :
+         {&data_set.train, &data_set.cv, &data_set.test}) {
+      labels.insert(labels.end(), examples->labels.begin(),
+                    examples->labels.end());
+    }
+    return labels;
+  };
+  const vector<Label> labels = all_labels();
 
   FLAGS_noise_prob = 1;
-  ReadData(&train_examples, &cv_examples, &test_examples);
-  EXPECT_EQ(-train_label_0, train_examples[0].label);
-  EXPECT_EQ(-train_label_1, train_examples[1].label);
-  EXPECT_EQ(-cv_label_0, cv_examples[0].label);
-  EXPECT_EQ(-test_label_0, test_examples[0].label);
+  ReadDataSet(&data_set);
+  const vector<Label> flipped_labels = all_labels();
+  for (size_t i = 0; i < labels.size(); ++i) {
+    EXPECT_EQ(-labels[i], flipped_labels[i]);
+  }
 
   FLAGS_noise_prob = 0.5;
   const int kIterations = 100;
   double sum_labels = 0.0;
   for (int i = 0; i < kIterations; ++i) {
-    ReadData(&train_examples, &cv_examples, &test_examples);
-    sum_labels += train_examples[0].label;
-    sum_labels += train_examples[1].label;
-    sum_labels += cv_examples[0].label;
-    sum_labels += test_examples[0].label;
+    ReadDataSet(&data_set);
+    for (Label label : all_labels()) {
+      sum_labels += label;
+    }
   }
   // The average of uniformly random +1/-1 labels should be about 0
   EXPECT_NEAR(0, sum_labels / (4 * kIterations), 1e-2);
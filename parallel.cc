@@ -0,0 +1,221 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+DEFINE_int32(num_threads, 1,
+             "Number of threads used for training. Required: "
+             "num_threads >= 1.");
+
+// The calls fn(i) for every i in [0, n) made by a call to ParallelFor(), or by
+// a BackgroundParallelFor.
+struct ParallelJob {
+  ParallelJob(int n, const std::function<void(int)>* fn)
+      : fn(fn), n(n), next_index(0) {}
+
+  const std::function<void(int)>* const fn;
+  const int n;
+  std::atomic<int> next_index;  // Next index to claim.
+  int num_workers = 0;  // Number of workers making calls of the job.
+};
+
+namespace {
+
+// True on pool threads, and on the calling thread while it runs a job.
+thread_local bool in_parallel_for = false;
+
+// A fixed set of worker threads, which make the calls of any job started by
+// Start(). The thread that starts a job works on it alongside the workers
+// when it calls Finish(), so a pool of num_threads threads has
+// num_threads - 1 workers.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int num_threads);
+  ~ThreadPool();
+
+  int num_threads() const { return workers_.size() + 1; }
+
+  // Let the workers start on the calls of job.
+  void Start(ParallelJob* job);
+
+  // Make the calls of job that have not started yet, and wait for all its
+  // calls to finish.
+  void Finish(ParallelJob* job);
+
+ private:
+  // Main loop of a worker thread.
+  void Work();
+
+  // Claim and run indices of job until none are left.
+  static void RunIndices(ParallelJob* job);
+
+  std::mutex mutex_;
+  std::condition_variable job_ready_;
+  std::condition_variable job_done_;
+  // Jobs started and not yet finished, oldest first. Workers take the oldest.
+  std::vector<ParallelJob*> jobs_;
+  bool stopping_ = false;
+  std::vector<std::thread> workers_;
+};
+
+ThreadPool::ThreadPool(int num_threads) {
+  CHECK_GE(num_threads, 1);
+  for (int i = 1; i < num_threads; ++i) {
+    workers_.emplace_back(&ThreadPool::Work, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  job_ready_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+void ThreadPool::Start(ParallelJob* job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.push_back(job);
+  }
+  job_ready_.notify_all();
+}
+
+void ThreadPool::Finish(ParallelJob* job) {
+  RunIndices(job);
+  std::unique_lock<std::mutex> lock(mutex_);
+  // Every index is claimed, so no other worker should take the job.
+  jobs_.erase(std::remove(jobs_.begin(), jobs_.end(), job), jobs_.end());
+  job_done_.wait(lock, [job] { return job->num_workers == 0; });
+}
+
+void ThreadPool::Work() {
+  in_parallel_for = true;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    job_ready_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+    if (stopping_) return;
+    ParallelJob* job = jobs_.front();
+    ++job->num_workers;
+    lock.unlock();
+    RunIndices(job);
+    lock.lock();
+    jobs_.erase(std::remove(jobs_.begin(), jobs_.end(), job), jobs_.end());
+    if (--job->num_workers == 0) job_done_.notify_all();
+  }
+}
+
+void ThreadPool::RunIndices(ParallelJob* job) {
+  for (int i = job->next_index++; i < job->n; i = job->next_index++) {
+    (*job->fn)(i);
+  }
+}
+
+std::mutex pool_mutex;
+std::unique_ptr<ThreadPool> pool;  // Guarded by pool_mutex.
+int num_pool_jobs = 0;  // Number of jobs using pool. Guarded by pool_mutex.
+
+// Return the pool, with --num_threads threads unless it is in use by other
+// jobs, and count one more job using it.
+ThreadPool* AcquirePool() {
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  if (pool == nullptr ||
+      (num_pool_jobs == 0 && pool->num_threads() != FLAGS_num_threads)) {
+    pool.reset(new ThreadPool(FLAGS_num_threads));
+  }
+  ++num_pool_jobs;
+  return pool.get();
+}
+
+// Return the pool, while it is in use by the calling job.
+ThreadPool* AcquiredPool() {
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  CHECK_GT(num_pool_jobs, 0);
+  return pool.get();
+}
+
+// Count one less job using the pool.
+void ReleasePool() {
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  --num_pool_jobs;
+}
+
+// Should calls of a job of size n be spread across the pool?
+bool UsePool(int n) {
+  return FLAGS_num_threads > 1 && n > 1 && !in_parallel_for;
+}
+
+}  // namespace
+
+void ParallelFor(int n, const std::function<void(int)>& fn) {
+  if (!UsePool(n)) {
+    for (int i = 0; i < n; ++i) {
+      fn(i);
+    }
+    return;
+  }
+  ThreadPool* thread_pool = AcquirePool();
+  ParallelJob job(n, &fn);
+  in_parallel_for = true;
+  thread_pool->Start(&job);
+  thread_pool->Finish(&job);
+  in_parallel_for = false;
+  ReleasePool();
+}
+
+BackgroundParallelFor::BackgroundParallelFor(int n,
+                                             std::function<void(int)> fn)
+    : n_(n), fn_(std::move(fn)) {
+  if (UsePool(n_)) {
+    job_.reset(new ParallelJob(n_, &fn_));
+    AcquirePool()->Start(job_.get());
+  }
+}
+
+BackgroundParallelFor::~BackgroundParallelFor() {
+  if (!done_) Wait();
+}
+
+void BackgroundParallelFor::Wait() {
+  CHECK(!done_);
+  done_ = true;
+  const bool was_in_parallel_for = in_parallel_for;
+  in_parallel_for = true;
+  if (job_ == nullptr) {
+    for (int i = 0; i < n_; ++i) {
+      fn_(i);
+    }
+  } else {
+    AcquiredPool()->Finish(job_.get());
+    ReleasePool();
+  }
+  in_parallel_for = was_in_parallel_for;
+}
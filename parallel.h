@@ -0,0 +1,57 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <functional>
+#include <memory>
+
+// Call fn(i) for every i in [0, n), spreading the calls across a pool of
+// --num_threads threads, and return once all calls have finished. The calls
+// can happen in any order, so to get deterministic results fn should only
+// write to state owned by index i, and the caller should combine the results
+// in index order afterwards. Calls to ParallelFor() from inside fn run
+// serially on the calling thread. Calls from several threads at the same time
+// share the pool.
+void ParallelFor(int n, const std::function<void(int)>& fn);
+
+struct ParallelJob;
+
+// Calls fn(i) for every i in [0, n), like ParallelFor(), but in the
+// background: the threads of the pool start on the calls right away, while
+// the thread that made the object goes on with other work, such as calls to
+// ParallelFor(). Wait() makes the calls that have not started yet on the
+// calling thread, and returns once all calls have finished. With one thread,
+// all the calls are made by Wait(). Whatever fn uses must stay valid until
+// Wait() returns.
+class BackgroundParallelFor {
+ public:
+  BackgroundParallelFor(int n, std::function<void(int)> fn);
+  // Calls Wait(), if it has not been called yet.
+  ~BackgroundParallelFor();
+
+  void Wait();
+
+ private:
+  const int n_;
+  const std::function<void(int)> fn_;
+  // The calls being made by the pool, or null if they are all left to Wait().
+  std::unique_ptr<ParallelJob> job_;
+  bool done_ = false;
+};
+
+#endif  // PARALLEL_H_
@@ -0,0 +1,113 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <thread>
+#include <vector>
+
+#include "parallel.h"
+
+#include "gflags/gflags.h"
+#include "gtest/gtest.h"
+
+DECLARE_int32(num_threads);
+
+using std::vector;
+
+TEST(ParallelTest, TestParallelForCallsEveryIndexOnce) {
+  for (int num_threads : {1, 2, 4}) {
+    FLAGS_num_threads = num_threads;
+    vector<int> num_calls(1000, 0);
+    ParallelFor(num_calls.size(), [&num_calls](int i) { ++num_calls[i]; });
+    for (size_t i = 0; i < num_calls.size(); ++i) {
+      EXPECT_EQ(1, num_calls[i]);
+    }
+  }
+  FLAGS_num_threads = 1;
+}
+
+TEST(ParallelTest, TestParallelForEmpty) {
+  FLAGS_num_threads = 4;
+  int num_calls = 0;
+  ParallelFor(0, [&num_calls](int) { ++num_calls; });
+  EXPECT_EQ(0, num_calls);
+  FLAGS_num_threads = 1;
+}
+
+TEST(ParallelTest, TestNestedParallelFor) {
+  FLAGS_num_threads = 4;
+  vector<vector<int>> num_calls(10, vector<int>(10, 0));
+  ParallelFor(num_calls.size(), [&num_calls](int i) {
+    ParallelFor(num_calls[i].size(),
+                [&num_calls, i](int j) { ++num_calls[i][j]; });
+  });
+  for (size_t i = 0; i < num_calls.size(); ++i) {
+    for (size_t j = 0; j < num_calls[i].size(); ++j) {
+      EXPECT_EQ(1, num_calls[i][j]);
+    }
+  }
+  FLAGS_num_threads = 1;
+}
+
+TEST(ParallelTest, TestConcurrentParallelFor) {
+  // Calls from two threads at the same time share the pool.
+  FLAGS_num_threads = 4;
+  vector<int> num_calls(1000, 0), other_num_calls(1000, 0);
+  std::thread thread([&other_num_calls]() {
+    for (int k = 0; k < 10; ++k) {
+      ParallelFor(other_num_calls.size(),
+                  [&other_num_calls](int i) { ++other_num_calls[i]; });
+    }
+  });
+  for (int k = 0; k < 10; ++k) {
+    ParallelFor(num_calls.size(), [&num_calls](int i) { ++num_calls[i]; });
+  }
+  thread.join();
+  for (size_t i = 0; i < num_calls.size(); ++i) {
+    EXPECT_EQ(10, num_calls[i]);
+    EXPECT_EQ(10, other_num_calls[i]);
+  }
+  FLAGS_num_threads = 1;
+}
+
+TEST(ParallelTest, TestBackgroundParallelFor) {
+  for (int num_threads : {1, 4}) {
+    FLAGS_num_threads = num_threads;
+    vector<int> num_calls(1000, 0), other_num_calls(1000, 0);
+    BackgroundParallelFor background(
+        num_calls.size(), [&num_calls](int i) { ++num_calls[i]; });
+    ParallelFor(other_num_calls.size(),
+                [&other_num_calls](int i) { ++other_num_calls[i]; });
+    background.Wait();
+    for (size_t i = 0; i < num_calls.size(); ++i) {
+      EXPECT_EQ(1, num_calls[i]);
+      EXPECT_EQ(1, other_num_calls[i]);
+    }
+  }
+  FLAGS_num_threads = 1;
+}
+
+TEST(ParallelTest, TestBackgroundParallelForWaitsWhenDestroyed) {
+  FLAGS_num_threads = 4;
+  vector<int> num_calls(1000, 0);
+  {
+    BackgroundParallelFor background(
+        num_calls.size(), [&num_calls](int i) { ++num_calls[i]; });
+  }
+  for (size_t i = 0; i < num_calls.size(); ++i) {
+    EXPECT_EQ(1, num_calls[i]);
+  }
+  FLAGS_num_threads = 1;
+}
@@ -0,0 +1,187 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "scorer.h"
+
+#include <stdint.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "glog/logging.h"
+#include "tree.h"
+
+// Number of examples scored together by ScoreExamples().
+static const int kBlockSize = 8;
+
+CompiledModel CompileModel(const Model& model) {
+  CompiledModel compiled_model;
+  for (const pair<Weight, FrozenTree>& wgtd_tree : model) {
+    // Trees with zero weight do not change the margin.
+    if (wgtd_tree.first == 0) continue;
+    const FrozenTree& tree = wgtd_tree.second;
+    CHECK_GE(tree.size(), 1);
+    // Map the node ids of tree to compiled ids.
+    const NodeId num_nodes = tree.size();
+    vector<NodeId> compiled_ids(num_nodes);
+    for (NodeId node_id = 0; node_id < num_nodes; ++node_id) {
+      const FrozenNode& node = tree[node_id];
+      if (node.leaf) {
+        compiled_ids[node_id] = ~static_cast<NodeId>(
+            compiled_model.leaf_values.size());
+        compiled_model.leaf_values.push_back(wgtd_tree.first * node.label);
+      } else {
+        compiled_ids[node_id] = compiled_model.split_features.size();
+        compiled_model.split_features.push_back(node.split_feature);
+        compiled_model.split_values.push_back(node.split_value);
+      }
+    }
+    for (const FrozenNode& node : tree) {
+      if (!node.leaf) {
+        compiled_model.child_ids.push_back(compiled_ids[node.left_child_id]);
+        compiled_model.child_ids.push_back(compiled_ids[node.right_child_id]);
+      }
+    }
+    compiled_model.root_ids.push_back(compiled_ids[0]);
+  }
+  return compiled_model;
+}
+
+float ScoreExample(const Example& example, const CompiledModel& model) {
+  float score = 0;
+  for (NodeId node_id : model.root_ids) {
+    while (node_id >= 0) {
+      const bool go_right = !(example.values[model.split_features[node_id]] <=
+                              model.split_values[node_id]);
+      node_id = model.child_ids[2 * node_id + go_right];
+    }
+    score += model.leaf_values[~node_id];
+  }
+  return score;
+}
+
+float ScoreExample(const ExampleSet& examples, int i,
+                   const CompiledModel& model) {
+  float score = 0;
+  for (NodeId node_id : model.root_ids) {
+    while (node_id >= 0) {
+      const bool go_right =
+          !(ExampleValue(examples, i, model.split_features[node_id]) <=
+            model.split_values[node_id]);
+      node_id = model.child_ids[2 * node_id + go_right];
+    }
+    score += model.leaf_values[~node_id];
+  }
+  return score;
+}
+
+// Add the margins of model on the kBlockSize examples of examples starting at
+// the begin-th to scores. Each tree is traversed by every example in the block
+// before moving to the next tree, so that its nodes stay in cache.
+static void ScoreBlock(const ExampleSet& examples, int begin,
+                       const CompiledModel& model, float* scores) {
+  const Value* values = examples.values.data() + begin;
+  const int64_t stride = examples.num_examples;
+  for (NodeId root_id : model.root_ids) {
+    for (int j = 0; j < kBlockSize; ++j) {
+      NodeId node_id = root_id;
+      while (node_id >= 0) {
+        const bool go_right =
+            !(values[model.split_features[node_id] * stride + j] <=
+              model.split_values[node_id]);
+        node_id = model.child_ids[2 * node_id + go_right];
+      }
+      scores[j] += model.leaf_values[~node_id];
+    }
+  }
+}
+
+#ifdef __AVX2__
+// Same as ScoreBlock(), but the examples in the block are scored together, one
+// per lane. The value of the split feature of each lane's node is gathered
+// straight from its column, at a 32-bit offset from the value of the first
+// feature for the begin-th example, so only the features the model splits on
+// are read. Requires num_features * num_examples <= INT32_MAX.
+static void ScoreBlockAvx2(const ExampleSet& examples, int begin,
+                           const CompiledModel& model, float* scores) {
+  const Value* values = examples.values.data() + begin;
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i strides = _mm256_set1_epi32(examples.num_examples);
+  const __m256i all_ones = _mm256_set1_epi32(-1);
+  __m256 score = _mm256_loadu_ps(scores);
+  for (NodeId root_id : model.root_ids) {
+    __m256i node_ids = _mm256_set1_epi32(root_id);
+    // Lanes whose examples have not yet reached a leaf.
+    __m256i active = _mm256_cmpgt_epi32(node_ids, all_ones);
+    while (!_mm256_testz_si256(active, active)) {
+      // Inactive lanes look up internal node 0 and discard the result.
+      const __m256i safe_ids = _mm256_and_si256(node_ids, active);
+      const __m256i features =
+          _mm256_i32gather_epi32(model.split_features.data(), safe_ids, 4);
+      const __m256 split_values =
+          _mm256_i32gather_ps(model.split_values.data(), safe_ids, 4);
+      const __m256i offsets =
+          _mm256_add_epi32(_mm256_mullo_epi32(features, strides), lanes);
+      const __m256 feature_values = _mm256_i32gather_ps(values, offsets, 4);
+      // Same as !(value <= split_value), including for NaN values.
+      const __m256i go_right = _mm256_castps_si256(
+          _mm256_cmp_ps(feature_values, split_values, _CMP_NLE_UQ));
+      // go_right is -1 in lanes that go right, so subtracting it adds one.
+      const __m256i child_indices =
+          _mm256_sub_epi32(_mm256_add_epi32(safe_ids, safe_ids), go_right);
+      const __m256i child_ids =
+          _mm256_i32gather_epi32(model.child_ids.data(), child_indices, 4);
+      node_ids = _mm256_blendv_epi8(node_ids, child_ids, active);
+      active = _mm256_cmpgt_epi32(node_ids, all_ones);
+    }
+    const __m256i leaf_ids = _mm256_xor_si256(node_ids, all_ones);
+    score = _mm256_add_ps(
+        score, _mm256_i32gather_ps(model.leaf_values.data(), leaf_ids, 4));
+  }
+  _mm256_storeu_ps(scores, score);
+}
+#endif
+
+void ScoreExamples(const ExampleSet& examples, const CompiledModel& model,
+                   vector<float>* scores) {
+  const int num_examples = examples.num_examples;
+  scores->assign(num_examples, 0);
+  int i = 0;
+  if (!examples.values.empty()) {
+    CHECK_EQ(examples.values.size(),
+             static_cast<int64_t>(examples.num_features) * num_examples);
+#ifdef __AVX2__
+    // Gathers take 32-bit offsets, so larger sets are scored without them.
+    const bool gather = examples.values.size() <= INT32_MAX;
+#endif
+    for (; i + kBlockSize <= num_examples; i += kBlockSize) {
+#ifdef __AVX2__
+      if (gather) {
+        ScoreBlockAvx2(examples, i, model, scores->data() + i);
+        continue;
+      }
+#endif
+      ScoreBlock(examples, i, model, scores->data() + i);
+    }
+  } else {
+    CHECK_EQ(examples.sparse_rows.offsets.size(), num_examples + 1)
+        << "Feature values must be in columns or sparse rows";
+  }
+  for (; i < num_examples; ++i) {
+    (*scores)[i] = ScoreExample(examples, i, model);
+  }
+}
@@ -0,0 +1,62 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef SCORER_H_
+#define SCORER_H_
+
+#include "types.h"
+
+// A model compiled for fast scoring. The nodes of all trees are packed into a
+// few flat arrays, one per node field, instead of a vector of trees of nodes.
+// Internal nodes and leaves are numbered separately. A child id c >= 0 refers
+// to internal node c, and a child id c < 0 refers to leaf ~c. The weight of
+// each tree is folded into the values of its leaves, so the margin of the
+// model on an example is the sum of the values of the leaves it reaches.
+typedef struct CompiledModel {
+  // Id of the root of each tree with non-zero weight, in model order. Uses the
+  // same encoding as the child ids.
+  vector<NodeId> root_ids;
+  // Split feature and value of each internal node.
+  vector<Feature> split_features;
+  vector<Value> split_values;
+  // child_ids[2 * i] and child_ids[2 * i + 1] are the left and right children
+  // of internal node i.
+  vector<NodeId> child_ids;
+  // Weight of the tree times the label of the leaf, for each leaf.
+  vector<float> leaf_values;
+} CompiledModel;
+
+// Return model compiled for scoring.
+CompiledModel CompileModel(const Model& model);
+
+// Return the margin of model on example, i.e. the weighted vote of its trees.
+// The model classifies example as positive if the margin is non-negative.
+float ScoreExample(const Example& example, const CompiledModel& model);
+
+// Same as ScoreExample(), for the i-th example of examples.
+float ScoreExample(const ExampleSet& examples, int i,
+                   const CompiledModel& model);
+
+// Set scores to the margins of model on examples, i.e., scores[i] is
+// ScoreExample(examples, i, model). The feature values of examples must be in
+// columns or in sparse rows. Examples in columns are scored in small blocks,
+// and each tree is traversed by all the examples in a block in lockstep. When
+// compiled with AVX2 support, the examples in a block are scored together in
+// SIMD registers.
+void ScoreExamples(const ExampleSet& examples, const CompiledModel& model,
+                   vector<float>* scores);
+
+#endif  // SCORER_H_
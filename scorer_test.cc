@@ -0,0 +1,141 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "scorer.h"
+#include "srm_test.h"
+
+#include "gtest/gtest.h"
+
+class ScorerTest : public SrmTest {
+ protected:
+  virtual void SetUp() {
+    SrmTest::SetUp();
+    // First tree splits on second feature, and gets example 3 wrong.
+    FrozenTree tree_0(3);
+    tree_0[0].leaf = false;
+    tree_0[0].split_feature = 1;
+    tree_0[0].split_value = 0.4;
+    tree_0[0].left_child_id = 1;
+    tree_0[0].right_child_id = 2;
+    tree_0[1].leaf = true;
+    tree_0[1].label = 1;
+    tree_0[2].leaf = true;
+    tree_0[2].label = -1;
+    // Second tree is a single leaf that labels everything negative.
+    FrozenTree tree_1(1);
+    tree_1[0].leaf = true;
+    tree_1[0].label = -1;
+    // Third tree splits on third feature, and has zero weight.
+    FrozenTree tree_2(3);
+    tree_2[0].leaf = false;
+    tree_2[0].split_feature = 2;
+    tree_2[0].split_value = 11.0;
+    tree_2[0].left_child_id = 1;
+    tree_2[0].right_child_id = 2;
+    tree_2[1].leaf = true;
+    tree_2[1].label = 1;
+    tree_2[2].leaf = true;
+    tree_2[2].label = -1;
+    model_.push_back(make_pair(0.7, tree_0));
+    model_.push_back(make_pair(0.2, tree_1));
+    model_.push_back(make_pair(0.0, tree_2));
+  }
+
+  Model model_;
+};
+
+TEST_F(ScorerTest, TestCompileModel) {
+  CompiledModel compiled_model = CompileModel(model_);
+  // Tree with zero weight is dropped.
+  EXPECT_EQ(2, compiled_model.root_ids.size());
+  EXPECT_EQ(0, compiled_model.root_ids[0]);
+  EXPECT_EQ(~2, compiled_model.root_ids[1]);
+  EXPECT_EQ(1, compiled_model.split_features.size());
+  EXPECT_EQ(1, compiled_model.split_features[0]);
+  EXPECT_NEAR(0.4, compiled_model.split_values[0], kTolerance);
+  vector<NodeId> child_ids = {~0, ~1};
+  EXPECT_EQ(child_ids, compiled_model.child_ids);
+  EXPECT_EQ(3, compiled_model.leaf_values.size());
+  EXPECT_NEAR(0.7, compiled_model.leaf_values[0], kTolerance);
+  EXPECT_NEAR(-0.7, compiled_model.leaf_values[1], kTolerance);
+  EXPECT_NEAR(-0.2, compiled_model.leaf_values[2], kTolerance);
+}
+
+TEST_F(ScorerTest, TestScoreExample) {
+  CompiledModel compiled_model = CompileModel(model_);
+  EXPECT_NEAR(0.5, ScoreExample(examples_[0], compiled_model), kTolerance);
+  EXPECT_NEAR(0.5, ScoreExample(examples_[1], compiled_model), kTolerance);
+  EXPECT_NEAR(0.5, ScoreExample(examples_[2], compiled_model), kTolerance);
+  EXPECT_NEAR(0.5, ScoreExample(examples_[3], compiled_model), kTolerance);
+  EXPECT_NEAR(-0.9, ScoreExample(examples_[4], compiled_model), kTolerance);
+}
+
+TEST_F(ScorerTest, TestScoreExampleEmptyModel) {
+  CompiledModel compiled_model = CompileModel(Model());
+  EXPECT_EQ(0, ScoreExample(examples_[0], compiled_model));
+}
+
+TEST_F(ScorerTest, TestScoreExamples) {
+  CompiledModel compiled_model = CompileModel(model_);
+  // Enough examples for several full blocks and a partial block.
+  vector<Example> examples;
+  for (int i = 0; i < 7; ++i) {
+    for (const Example& example : examples_) {
+      examples.push_back(example);
+      examples.back().values[1] += 0.1 * i;
+    }
+  }
+  const ExampleSet example_set = MakeExampleSet(examples);
+  vector<float> scores;
+  ScoreExamples(example_set, compiled_model, &scores);
+  ASSERT_EQ(examples.size(), scores.size());
+  for (size_t i = 0; i < examples.size(); ++i) {
+    EXPECT_EQ(ScoreExample(examples[i], compiled_model), scores[i]);
+    EXPECT_EQ(scores[i], ScoreExample(example_set, i, compiled_model));
+  }
+}
+
+TEST_F(ScorerTest, TestScoreSparseExamples) {
+  CompiledModel compiled_model = CompileModel(model_);
+  // Zero out some values, and store the others in sparse rows.
+  vector<Example> examples = examples_;
+  examples[0].values[1] = 0;
+  examples[3].values[0] = 0;
+  examples[4].values[1] = 0;
+  ExampleSet example_set = MakeExampleSet(examples);
+  example_set.values.clear();
+  SparseRows& rows = example_set.sparse_rows;
+  rows.num_features = example_set.num_features;
+  rows.offsets.push_back(0);
+  for (const Example& example : examples) {
+    for (Feature j = 0; j < rows.num_features; ++j) {
+      if (example.values[j] != 0) {
+        rows.features.push_back(j);
+        rows.values.push_back(example.values[j]);
+      }
+    }
+    rows.offsets.push_back(rows.features.size());
+  }
+  vector<float> scores;
+  ScoreExamples(example_set, compiled_model, &scores);
+  ASSERT_EQ(examples.size(), scores.size());
+  for (size_t i = 0; i < examples.size(); ++i) {
+    EXPECT_EQ(ScoreExample(examples[i], compiled_model), scores[i]);
+    EXPECT_EQ(scores[i], ScoreExample(example_set, i, compiled_model));
+  }
+  // Example 4 now goes left at the split on its zero value.
+  EXPECT_NEAR(0.5, scores[4], kTolerance);
+}
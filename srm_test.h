@@ -20,6 +20,41 @@ limitations under the License.
 #include "types.h"
 #include "gtest/gtest.h"
 
+// Return a set of the examples, in order, with their feature values in
+// columns.
+inline ExampleSet MakeExampleSet(const vector<Example>& examples) {
+  ExampleSet example_set;
+  example_set.num_examples = examples.size();
+  example_set.num_features = examples.empty() ? 0 : examples[0].values.size();
+  example_set.values.resize(example_set.num_features * examples.size());
+  for (size_t i = 0; i < examples.size(); ++i) {
+    example_set.labels.push_back(examples[i].label);
+    example_set.weights.push_back(examples[i].weight);
+    for (Feature j = 0; j < example_set.num_features; ++j) {
+      example_set.values[j * examples.size() + i] = examples[i].values[j];
+    }
+  }
+  return example_set;
+}
+
+// Expect tree and other_tree to have the same nodes, with the same ids. The
+// split of a node is only compared if it is not a leaf.
+inline void ExpectSameTree(const Tree& tree, const Tree& other_tree) {
+  ASSERT_EQ(tree.size(), other_tree.size());
+  for (size_t i = 0; i < tree.size(); ++i) {
+    EXPECT_EQ(tree[i].leaf, other_tree[i].leaf);
+    EXPECT_EQ(tree[i].depth, other_tree[i].depth);
+    EXPECT_EQ(tree[i].positive_weight, other_tree[i].positive_weight);
+    EXPECT_EQ(tree[i].negative_weight, other_tree[i].negative_weight);
+    if (!tree[i].leaf) {
+      EXPECT_EQ(tree[i].split_feature, other_tree[i].split_feature);
+      EXPECT_EQ(tree[i].split_value, other_tree[i].split_value);
+      EXPECT_EQ(tree[i].left_child_id, other_tree[i].left_child_id);
+      EXPECT_EQ(tree[i].right_child_id, other_tree[i].right_child_id);
+    }
+  }
+}
+
 class SrmTest : public ::testing::Test {
  protected:
   virtual void SetUp() {
@@ -46,9 +81,11 @@ class SrmTest : public ::testing::Test {
     examples_arr[4].label = -1;
     examples_arr[4].weight = 0.2;
     examples_.assign(examples_arr, examples_arr + 5);
+    example_set_ = MakeExampleSet(examples_);
   }
 
   vector<Example> examples_;
+  ExampleSet example_set_;  // Same as examples_.
 };
 
 #endif  // SRM_TEST_H_
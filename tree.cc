@@ -15,41 +15,251 @@ limitations under the License.
 */
 
 #include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <functional>
+#include <numeric>
 
 #include "tree.h"
 
 #include "gflags/gflags.h"
 #include "glog/logging.h"
+#include "parallel.h"
+
+DEFINE_int32(max_bins, 0,
+             "Maximum number of bins per feature used to search for splits. "
+             "If 0, every distinct feature value is its own bin, and split "
+             "search is exact. Required: max_bins >= 0, and max_bins >= 1 "
+             "for a sparse data set or if train_on_disk.");
+
+// Return the value of feature for the i-th example on disk in columns.
+static inline Value DiskValue(const DiskColumns& columns, Feature feature,
+                              int i) {
+  return columns.values[feature * columns.num_file_rows + columns.rows[i]];
+}
+
+// Return the column of feature in examples, whose feature values must be in
+// columns.
+static inline const Value* Column(const ExampleSet& examples,
+                                  Feature feature) {
+  return examples.values.data() +
+         static_cast<int64_t>(feature) * examples.num_examples;
+}
+
+// Return whether the feature values of examples are in sparse rows.
+static inline bool IsSparse(const ExampleSet& examples) {
+  return examples.values.empty() && !examples.sparse_rows.offsets.empty();
+}
+
+// Return the Rademacher complexity term of ComplexityPenalty() for a tree of
+// tree_size nodes, trained with context.
+static float Rademacher(const TreeContext& context, int tree_size) {
+  return sqrt(((2 * tree_size + 1) * (log(context.num_features + 2) / log(2)) *
+               log(context.num_examples)) /
+              context.num_examples);
+}
+
+void InitializeTreeContext(const ExampleSet& examples,
+                           const FeatureIndex& index,
+                           const vector<Weight>& weights,
+                           TreeContext* context) {
+  CHECK_GE(examples.num_examples, 1);
+  CHECK_EQ(weights.size(), examples.num_examples);
+  if (index.disk_columns != nullptr) {
+    CHECK_EQ(index.disk_columns->rows.size(), examples.num_examples);
+  }
+  CHECK_EQ(index.values.size(), examples.num_features);
+  CHECK_GE(context->tree_depth, 0);
+  context->feature_index = &index;
+  context->weights = &weights;
+  context->weight_scale = 1;
+  context->num_examples = examples.num_examples;
+  context->num_features = examples.num_features;
+  // Every leaf of a tree has at least one example, so a tree has at most
+  // 2 * num_examples - 1 nodes, and at most 2^(tree_depth + 1) - 1 nodes.
+  int64_t max_tree_size = 2 * static_cast<int64_t>(examples.num_examples) - 1;
+  if (context->tree_depth < 30) {
+    max_tree_size =
+        std::min(max_tree_size, (int64_t{1} << (context->tree_depth + 1)) - 1);
+  }
+  context->rademacher.resize(max_tree_size + 1);
+  for (int tree_size = 0; tree_size <= max_tree_size; ++tree_size) {
+    context->rademacher[tree_size] = Rademacher(*context, tree_size);
+  }
+}
+
+// Return the bin of value, given the largest value in each bin.
+static inline int ValueToBin(const vector<Value>& bin_values, Value value) {
+  return std::lower_bound(bin_values.begin(), bin_values.end(), value) -
+         bin_values.begin();
+}
+
+// Return the largest value in each bin of the values of a feature, in
+// increasing order, with at most max_bins bins if max_bins is positive. column
+// holds the value of the feature for each example, except for num_zeros more
+// examples whose value is zero.
+static vector<Value> MakeBinValues(vector<Value> column, int64_t num_zeros,
+                                   int max_bins) {
+  if (num_zeros > 0) column.push_back(0);
+  std::sort(column.begin(), column.end());
+  vector<Value> values;
+  vector<int64_t> counts;
+  for (const Value value : column) {
+    if (values.empty() || value > values.back()) {
+      values.push_back(value);
+      counts.push_back(0);
+    }
+    ++counts.back();
+  }
+  if (num_zeros > 1) counts[ValueToBin(values, 0)] += num_zeros - 1;
+  if (max_bins > 0 && values.size() > static_cast<size_t>(max_bins)) {
+    // Merge consecutive distinct values into bins, closing a bin once it
+    // brings the number of examples seen so far up to its quantile.
+    vector<Value> bin_values;
+    const int64_t num_total =
+        column.size() + std::max<int64_t>(num_zeros - 1, 0);
+    int64_t num_seen = 0;
+    for (size_t rank = 0; rank < values.size(); ++rank) {
+      const int64_t bin = bin_values.size();
+      num_seen += counts[rank];
+      if (rank == values.size() - 1 ||
+          num_seen * max_bins >= (bin + 1) * num_total) {
+        bin_values.push_back(values[rank]);
+      }
+    }
+    values.swap(bin_values);
+  }
+  return values;
+}
 
-DEFINE_double(beta, -1.0, "beta parameter for gradient.");
-DEFINE_double(lambda, -1.0, "lambda parameter for gradient.");
-DEFINE_int32(tree_depth, -1,
-             "Maximum depth of each decision tree. The root node has depth 0. "
-             "Required: tree_depth >= 0.");
+// Return the feature index of num_rows examples whose feature values are in
+// rows.
+static FeatureIndex MakeSparseFeatureIndex(const SparseRows& rows,
+                                           int num_rows) {
+  // Without bins, the value-to-weights vectors of a level, which are kept for
+  // every node of the level, could hold every distinct value of every feature
+  // for each node.
+  CHECK_GT(FLAGS_max_bins, 0) << "Sparse training requires --max_bins > 0";
+  const int sparse_num_features = rows.num_features;
+  FeatureIndex index;
+  index.disk_columns = nullptr;
+  index.max_bins = FLAGS_max_bins;
+  SparseColumns& columns = index.sparse_columns;
+  columns.offsets.assign(sparse_num_features + 1, 0);
+  for (int64_t k = 0; k < rows.offsets[num_rows]; ++k) {
+    ++columns.offsets[rows.features[k] + 1];
+  }
+  for (Feature feature = 0; feature < sparse_num_features; ++feature) {
+    columns.offsets[feature + 1] += columns.offsets[feature];
+  }
+  const int64_t num_stored = columns.offsets.back();
+  columns.positions.resize(num_stored);
+  columns.ranks.resize(num_stored);
+  columns.zero_ranks.resize(sparse_num_features);
+  vector<Value> stored_values(num_stored);
+  vector<int64_t> next(columns.offsets.begin(), columns.offsets.end() - 1);
+  for (int i = 0; i < num_rows; ++i) {
+    for (int64_t k = rows.offsets[i]; k < rows.offsets[i + 1]; ++k) {
+      const int64_t column_k = next[rows.features[k]]++;
+      columns.positions[column_k] = i;
+      stored_values[column_k] = rows.values[k];
+    }
+  }
+  index.values.assign(sparse_num_features, vector<Value>());
+  ParallelFor(sparse_num_features, [&](int feature) {
+    const int64_t begin = columns.offsets[feature];
+    const int64_t end = columns.offsets[feature + 1];
+    const int64_t num_zeros = num_rows - (end - begin);
+    vector<Value>& bin_values = index.values[feature];
+    bin_values = MakeBinValues(
+        vector<Value>(stored_values.begin() + begin,
+                      stored_values.begin() + end),
+        num_zeros, index.max_bins);
+    for (int64_t k = begin; k < end; ++k) {
+      columns.ranks[k] = ValueToBin(bin_values, stored_values[k]);
+    }
+    columns.zero_ranks[feature] =
+        (num_zeros > 0) ? ValueToBin(bin_values, 0) : -1;
+  });
+  return index;
+}
+
+FeatureIndex MakeFeatureIndex(const ExampleSet& examples) {
+  CHECK_GE(examples.num_examples, 1);
+  if (IsSparse(examples)) {
+    return MakeSparseFeatureIndex(examples.sparse_rows, examples.num_examples);
+  }
+  CHECK_EQ(examples.values.size(),
+           static_cast<int64_t>(examples.num_features) *
+               examples.num_examples);
+  FeatureIndex index;
+  index.disk_columns = nullptr;
+  index.max_bins = FLAGS_max_bins;
+  index.values.resize(examples.num_features);
+  index.ranks.assign(examples.num_features,
+                     vector<int>(examples.num_examples, 0));
+  for (Feature feature = 0; feature < examples.num_features; ++feature) {
+    const Value* column = Column(examples, feature);
+    vector<Value>& values = index.values[feature];
+    values = MakeBinValues(
+        vector<Value>(column, column + examples.num_examples), 0,
+        index.max_bins);
+    vector<int>& ranks = index.ranks[feature];
+    for (int i = 0; i < examples.num_examples; ++i) {
+      ranks[i] = ValueToBin(values, column[i]);
+    }
+  }
+  return index;
+}
+
+Value SparseValue(const SparseRows& rows, int row, Feature feature) {
+  const Feature* begin = rows.features.data() + rows.offsets[row];
+  const Feature* end = rows.features.data() + rows.offsets[row + 1];
+  const Feature* it = std::lower_bound(begin, end, feature);
+  if (it == end || *it != feature) return 0;
+  return rows.values[it - rows.features.data()];
+}
 
-// TODO(usyed): Global variables are bad style.
-static int num_features;
-static int num_examples;
-static float the_normalizer;
-static bool is_initialized = false;
+Value ExampleValue(const ExampleSet& examples, int i, Feature feature) {
+  if (!examples.values.empty()) return Column(examples, feature)[i];
+  return SparseValue(examples.sparse_rows, i, feature);
+}
 
-void InitializeTreeData(const vector<Example>& examples, float normalizer) {
-  CHECK_GE(examples.size(), 1);
-  num_examples = examples.size();
-  num_features = examples[0].values.size();
-  the_normalizer = normalizer;
-  is_initialized = true;
+FeatureIndex MakeDiskFeatureIndex(const DiskColumns* columns) {
+  // Only the bins are needed, since examples are binned as they are streamed
+  // from disk. Read one column at a time.
+  CHECK_GT(FLAGS_max_bins, 0) << "Training on disk requires --max_bins > 0";
+  CHECK_GE(columns->rows.size(), 1);
+  FeatureIndex index;
+  index.disk_columns = columns;
+  index.max_bins = FLAGS_max_bins;
+  index.values.assign(columns->num_features, vector<Value>());
+  ParallelFor(columns->num_features, [&](int feature) {
+    vector<Value> column(columns->rows.size());
+    for (size_t i = 0; i < columns->rows.size(); ++i) {
+      column[i] = DiskValue(*columns, feature, i);
+    }
+    index.values[feature] =
+        MakeBinValues(std::move(column), 0, index.max_bins);
+  });
+  return index;
 }
 
-Node MakeRootNode(const vector<Example>& examples) {
+Node MakeRootNode(const TreeContext& context, const ExampleSet& examples,
+                  vector<int>* rows) {
+  const vector<Weight>& weights = *context.weights;
   Node root;
-  root.examples = examples;
+  rows->resize(examples.num_examples);
+  std::iota(rows->begin(), rows->end(), 0);
+  root.rows_begin = 0;
+  root.rows_end = rows->size();
   root.positive_weight = root.negative_weight = 0;
-  for (const Example& example : examples) {
-    if (example.label == 1) {
-      root.positive_weight += example.weight;
+  for (int i = 0; i < examples.num_examples; ++i) {
+    if (examples.labels[i] == 1) {
+      root.positive_weight += weights[i];
     } else {  // label == -1
-      root.negative_weight += example.weight;
+      root.negative_weight += weights[i];
     }
   }
   root.leaf = true;
@@ -57,47 +267,110 @@ Node MakeRootNode(const vector<Example>& examples) {
   return root;
 }
 
-map<Value, pair<Weight, Weight>> MakeValueToWeightsMap(const Node& node,
-                                                       Feature feature) {
-  map<Value, pair<Weight, Weight>> value_to_weights;
-  for (const Example& example : node.examples) {
-    if (example.label == 1) {
-      value_to_weights[example.values[feature]].first += example.weight;
+vector<pair<Weight, Weight>> MakeValueToWeights(const TreeContext& context,
+                                                const ExampleSet& examples,
+                                                const vector<int>& rows,
+                                                const Node& node,
+                                                Feature feature) {
+  const FeatureIndex& index = *context.feature_index;
+  CHECK_EQ(index.ranks.size(), context.num_features)
+      << "The feature index has no ranks";
+  const vector<Weight>& example_weights = *context.weights;
+  const vector<int>& ranks = index.ranks[feature];
+  vector<pair<Weight, Weight>> value_to_weights(index.values[feature].size());
+  for (int i = node.rows_begin; i < node.rows_end; ++i) {
+    const int row = rows[i];
+    pair<Weight, Weight>& weights = value_to_weights[ranks[row]];
+    if (examples.labels[row] == 1) {
+      weights.first += example_weights[row];
     } else {  // label = -1
-      value_to_weights[example.values[feature]].second += example.weight;
+      weights.second += example_weights[row];
     }
   }
   return value_to_weights;
 }
 
-void BestSplitValue(const map<Value, pair<Weight, Weight>>& value_to_weights,
-                    const Node& node, int tree_size, Value* split_value,
-                    float* delta_gradient) {
+// Same as Gradient(), given the complexity penalty of the tree.
+static inline float GradientWithPenalty(float wgtd_error,
+                                        float complexity_penalty, float alpha,
+                                        int sign_edge) {
+  // TODO(usyed): Can we make some mild assumptions and get rid of sign_edge?
+  const float edge = wgtd_error - 0.5;
+  const int sign_alpha = (alpha >= 0) ? 1 : -1;
+  if (fabs(alpha) > kTolerance) {
+    return edge + sign_alpha * complexity_penalty;
+  } else if (fabs(edge) <= complexity_penalty) {
+    return 0;
+  } else {
+    return edge - sign_edge * complexity_penalty;
+  }
+}
+
+// Search the splits of node on feature at the num_entries ranks entry_rank(k),
+// in increasing order, whose weights are entry_weights(k), as BestSplitValue()
+// does. A rank that is skipped must have zero weights, since the split at it
+// is the same as the one at the rank before it, and only the first of equal
+// splits can be picked. Rank 0 must not be skipped.
+template <typename EntryRank, typename EntryWeights>
+static void ScanSplitValues(const TreeContext& context, Feature feature,
+                            const Node& node, int tree_size, int num_entries,
+                            EntryRank entry_rank, EntryWeights entry_weights,
+                            Value* split_value, float* delta_gradient) {
   *delta_gradient = 0;
   Weight left_positive_weight = 0, left_negative_weight = 0,
          right_positive_weight = node.positive_weight,
          right_negative_weight = node.negative_weight;
   float old_error = fmin(left_positive_weight + right_positive_weight,
-                         left_negative_weight + right_negative_weight);
-  float old_gradient = Gradient(old_error, tree_size, 0, -1);
-  for (const pair<Value, pair<Weight, Weight>>& elem : value_to_weights) {
-    left_positive_weight += elem.second.first;
-    right_positive_weight -= elem.second.first;
-    left_negative_weight += elem.second.second;
-    right_negative_weight -= elem.second.second;
-    float new_error = fmin(left_positive_weight, left_negative_weight) +
-                      fmin(right_positive_weight, right_negative_weight);
-    float new_gradient = Gradient(new_error, tree_size + 2, 0, -1);
+                         left_negative_weight + right_negative_weight) *
+                    context.weight_scale;
+  float old_gradient = GradientWithPenalty(
+      old_error, ComplexityPenalty(context, tree_size), 0, -1);
+  // The penalty is the same for every split, so the scan below does not call
+  // ComplexityPenalty().
+  const float new_complexity_penalty =
+      ComplexityPenalty(context, tree_size + 2);
+  for (int k = 0; k < num_entries; ++k) {
+    const pair<Weight, Weight>& weights = entry_weights(k);
+    left_positive_weight += weights.first;
+    right_positive_weight -= weights.first;
+    left_negative_weight += weights.second;
+    right_negative_weight -= weights.second;
+    float new_error = (fmin(left_positive_weight, left_negative_weight) +
+                       fmin(right_positive_weight, right_negative_weight)) *
+                      context.weight_scale;
+    float new_gradient =
+        GradientWithPenalty(new_error, new_complexity_penalty, 0, -1);
     if (fabs(new_gradient) - fabs(old_gradient) >
         *delta_gradient + kTolerance) {
       *delta_gradient = fabs(new_gradient) - fabs(old_gradient);
-      *split_value = elem.first;
+      *split_value = context.feature_index->values[feature][entry_rank(k)];
     }
   }
 }
 
-void MakeChildNodes(Feature split_feature, Value split_value, Node* parent,
-                    Tree* tree) {
+void BestSplitValue(const TreeContext& context,
+                    const vector<pair<Weight, Weight>>& value_to_weights,
+                    Feature feature, const Node& node, int tree_size,
+                    Value* split_value, float* delta_gradient) {
+  ScanSplitValues(
+      context, feature, node, tree_size, value_to_weights.size(),
+      [](int rank) { return rank; },
+      [&value_to_weights](int rank) -> const pair<Weight, Weight>& {
+        return value_to_weights[rank];
+      },
+      split_value, delta_gradient);
+}
+
+void MakeChildNodes(const TreeContext& context, const ExampleSet& examples,
+                    Feature split_feature, Value split_value, Node* parent,
+                    vector<int>* rows, vector<int>* scratch, Tree* tree) {
+  CHECK_EQ(context.feature_index->ranks.size(), context.num_features)
+      << "The feature index has no ranks";
+  CHECK_EQ(examples.values.size(),
+           static_cast<int64_t>(examples.num_features) *
+               examples.num_examples)
+      << "The feature values must be in columns";
+  const vector<Weight>& weights = *context.weights;
   parent->split_feature = split_feature;
   parent->split_value = split_value;
   parent->leaf = false;
@@ -106,19 +379,34 @@ void MakeChildNodes(Feature split_feature, Value split_value, Node* parent,
   left_child.leaf = right_child.leaf = true;
   left_child.positive_weight = left_child.negative_weight =
       right_child.positive_weight = right_child.negative_weight = 0;
-  for (const Example& example : parent->examples) {
-    Node* child;
-    if (example.values[split_feature] <= split_value) {
-      child = &left_child;
+  const Value* column = Column(examples, split_feature);
+  // The rows of the left child are moved down in place, and those of the right
+  // child are copied back after them from scratch.
+  const size_t num_rows = parent->rows_end - parent->rows_begin;
+  if (scratch->size() < num_rows) scratch->resize(num_rows);
+  int num_left_rows = 0, num_right_rows = 0;
+  for (int i = parent->rows_begin; i < parent->rows_end; ++i) {
+    const int row = (*rows)[i];
+    if (column[row] <= split_value) {
+      (*rows)[parent->rows_begin + num_left_rows++] = row;
     } else {
-      child = &right_child;
+      (*scratch)[num_right_rows++] = row;
     }
-    // TODO(usyed): Moving examples around is inefficient.
-    child->examples.push_back(example);
-    if (example.label == 1) {
-      child->positive_weight += example.weight;
-    } else {  // label == -1
-      child->negative_weight += example.weight;
+  }
+  std::copy(scratch->begin(), scratch->begin() + num_right_rows,
+            rows->begin() + parent->rows_begin + num_left_rows);
+  left_child.rows_begin = parent->rows_begin;
+  left_child.rows_end = right_child.rows_begin =
+      parent->rows_begin + num_left_rows;
+  right_child.rows_end = parent->rows_end;
+  for (Node* child : {&left_child, &right_child}) {
+    for (int i = child->rows_begin; i < child->rows_end; ++i) {
+      const int row = (*rows)[i];
+      if (examples.labels[row] == 1) {
+        child->positive_weight += weights[row];
+      } else {  // label == -1
+        child->negative_weight += weights[row];
+      }
     }
   }
   parent->left_child_id = tree->size();
@@ -127,41 +415,631 @@ void MakeChildNodes(Feature split_feature, Value split_value, Node* parent,
   tree->push_back(right_child);
 }
 
-Tree TrainTree(const vector<Example>& examples) {
-  CHECK(is_initialized);
-  Tree tree;
-  tree.push_back(MakeRootNode(examples));
-  NodeId node_id = 0;
-  while (node_id < tree.size()) {
-    Node& node = tree[node_id];  // TODO(usyed): Too bad this can't be const.
-    Feature best_split_feature;
-    Value best_split_value;
-    float best_delta_gradient = 0;
+// Return value_to_weights minus other_value_to_weights.
+static vector<pair<Weight, Weight>> SubtractValueToWeights(
+    const vector<pair<Weight, Weight>>& value_to_weights,
+    const vector<pair<Weight, Weight>>& other_value_to_weights) {
+  vector<pair<Weight, Weight>> difference(value_to_weights.size());
+  for (size_t rank = 0; rank < value_to_weights.size(); ++rank) {
+    difference[rank].first =
+        value_to_weights[rank].first - other_value_to_weights[rank].first;
+    difference[rank].second =
+        value_to_weights[rank].second - other_value_to_weights[rank].second;
+  }
+  return difference;
+}
+
+// Pick the best of the splits found for each feature, in feature order so
+// that ties are broken exactly as in a serial search, and return its
+// improvement in the gradient.
+static float PickBestSplit(const vector<Value>& split_values,
+                           const vector<float>& delta_gradients,
+                           Feature* best_split_feature,
+                           Value* best_split_value) {
+  float best_delta_gradient = 0;
+  for (Feature split_feature = 0;
+       split_feature < static_cast<Feature>(delta_gradients.size());
+       ++split_feature) {
+    if (delta_gradients[split_feature] > best_delta_gradient + kTolerance) {
+      best_delta_gradient = delta_gradients[split_feature];
+      *best_split_feature = split_feature;
+      *best_split_value = split_values[split_feature];
+    }
+  }
+  return best_delta_gradient;
+}
+
+// Find the best split of node over all features, given the value-to-weights
+// vector of each feature at node, and return its improvement in the gradient.
+// The features are searched in parallel.
+static float BestSplit(
+    const TreeContext& context,
+    const vector<vector<pair<Weight, Weight>>>& value_to_weights,
+    const Node& node, int tree_size, Feature* best_split_feature,
+    Value* best_split_value) {
+  const int num_features = context.num_features;
+  vector<Value> split_values(num_features);
+  vector<float> delta_gradients(num_features);
+  ParallelFor(num_features, [&](int split_feature) {
+    BestSplitValue(context, value_to_weights[split_feature], split_feature,
+                   node, tree_size, &split_values[split_feature],
+                   &delta_gradients[split_feature]);
+  });
+  return PickBestSplit(split_values, delta_gradients, best_split_feature,
+                       best_split_value);
+}
+
+namespace {
+
+// The bins of the feature values of training examples that are in columns,
+// given by their feature index.
+class DenseBins {
+ public:
+  DenseBins(const FeatureIndex& index, const ExampleSet& examples)
+      : index_(index), examples_(examples) {}
+
+  // ForEachBin() visits every example in rows.
+  static constexpr bool kVisitsAllRows = true;
+
+  // Call add(k, bin) for each k-th example in rows, in order, with the bin of
+  // its value of feature. rows are the positions of the examples to visit in
+  // increasing order, and if it is not empty, ks[i] is the index in rows of
+  // the i-th training example, or -1 if it is not in rows.
+  template <typename Add>
+  void ForEachBin(Feature feature, const vector<int>& rows,
+                  const vector<int>& /* ks */, Add add) const {
+    const int* ranks = index_.ranks[feature].data();
+    for (size_t k = 0; k < rows.size(); ++k) add(k, ranks[rows[k]]);
+  }
+
+  // Every example is visited by ForEachBin(), so there is nothing to add.
+  void AddZeroWeights(Feature /* feature */, const Node& /* node */,
+                      int /* num_zeros */,
+                      vector<pair<Weight, Weight>>* /* value_to_weights */)
+      const {}
+
+  // Return the value of feature for the i-th training example.
+  Value GetValue(Feature feature, int i) const {
+    return Column(examples_, feature)[i];
+  }
+
+ private:
+  const FeatureIndex& index_;
+  const ExampleSet& examples_;
+};
+
+// The bins of the feature values of training examples on disk, given by a
+// feature index made by MakeDiskFeatureIndex().
+class DiskBins {
+ public:
+  explicit DiskBins(const FeatureIndex& index)
+      : index_(index), columns_(*index.disk_columns) {}
+
+  // Same as DenseBins::kVisitsAllRows.
+  static constexpr bool kVisitsAllRows = true;
+
+  // Same as DenseBins::ForEachBin().
+  template <typename Add>
+  void ForEachBin(Feature feature, const vector<int>& rows,
+                  const vector<int>& /* ks */, Add add) const {
+    const vector<Value>& bin_values = index_.values[feature];
+    for (size_t k = 0; k < rows.size(); ++k) {
+      add(k, ValueToBin(bin_values, DiskValue(columns_, feature, rows[k])));
+    }
+  }
+
+  // Every example is visited by ForEachBin(), so there is nothing to add.
+  void AddZeroWeights(Feature /* feature */, const Node& /* node */,
+                      int /* num_zeros */,
+                      vector<pair<Weight, Weight>>* /* value_to_weights */)
+      const {}
+
+  // Return the value of feature for the i-th training example.
+  Value GetValue(Feature feature, int i) const {
+    return DiskValue(columns_, feature, i);
+  }
+
+ private:
+  const FeatureIndex& index_;
+  const DiskColumns& columns_;
+};
+
+// The bins of the feature values of training examples that are in rows,
+// given by a feature index made from rows.
+class SparseBins {
+ public:
+  SparseBins(const FeatureIndex& index, const SparseRows& rows)
+      : columns_(index.sparse_columns), rows_(rows) {}
+
+  // ForEachBin() only visits the examples in rows with a stored value.
+  static constexpr bool kVisitsAllRows = false;
+
+  // Like DenseBins::ForEachBin(), but only visits the examples with a stored
+  // value of feature, and requires ks.
+  template <typename Add>
+  void ForEachBin(Feature feature, const vector<int>& /* rows */,
+                  const vector<int>& ks, Add add) const {
+    for (int64_t j = columns_.offsets[feature];
+         j < columns_.offsets[feature + 1]; ++j) {
+      const int k = ks[columns_.positions[j]];
+      if (k >= 0) add(k, columns_.ranks[j]);
+    }
+  }
+
+  // Given the value-to-weights vector of feature at node with the weights of
+  // the examples visited by ForEachBin(), add the weights of the num_zeros
+  // other examples at node, which are node's weights minus the visited ones,
+  // to the bin of zero.
+  void AddZeroWeights(Feature feature, const Node& node, int num_zeros,
+                      vector<pair<Weight, Weight>>* value_to_weights) const {
+    if (num_zeros == 0) return;
+    const int zero_rank = columns_.zero_ranks[feature];
+    // Summed in double precision, since the difference is small relative to
+    // the sums.
+    double positive_weight = 0, negative_weight = 0;
+    for (const pair<Weight, Weight>& weights : *value_to_weights) {
+      positive_weight += weights.first;
+      negative_weight += weights.second;
+    }
+    (*value_to_weights)[zero_rank].first +=
+        node.positive_weight - positive_weight;
+    (*value_to_weights)[zero_rank].second +=
+        node.negative_weight - negative_weight;
+  }
+
+  Value GetValue(Feature feature, int i) const {
+    return SparseValue(rows_, i, feature);
+  }
+
+ private:
+  const SparseColumns& columns_;
+  const SparseRows& rows_;
+};
+
+}  // namespace
+
+// Version of TrainTree() for examples whose feature values are given by bins,
+// a DenseBins, DiskBins or SparseBins. The tree is grown one level at a time.
+// For each level, one sequential pass over the bins of each feature builds the
+// value-to-weights vectors of all the nodes of the level, and one pass over
+// the split features moves the examples of the split nodes to their children.
+// Only the node of each example is kept, instead of the rows of each node. The
+// nodes are searched in the same order as by TrainTreeByNode(), and for
+// DenseBins and DiskBins the weights are summed in the same order, so the
+// trees are the same, except that the value-to-weights vectors of the child of
+// a split with more examples are found by subtraction, which may round
+// differently.
+template <typename Bins>
+static Tree TrainTreeByLevel(const TreeContext& context,
+                             const ExampleSet& examples, const Bins& bins) {
+  const FeatureIndex& feature_index = *context.feature_index;
+  const vector<Weight>& example_weights = *context.weights;
+  const int num_features = context.num_features;
+  Tree tree(1);
+  Node& root = tree[0];
+  root.rows_begin = root.rows_end = 0;  // Examples are found by node_ids.
+  root.positive_weight = root.negative_weight = 0;
+  const int n = examples.num_examples;
+  for (int i = 0; i < n; ++i) {
+    if (examples.labels[i] == 1) {
+      root.positive_weight += example_weights[i];
+    } else {  // label == -1
+      root.negative_weight += example_weights[i];
+    }
+  }
+  root.leaf = true;
+  root.depth = 0;
+  // node_ids[i] is the node of the i-th example.
+  vector<NodeId> node_ids(n, 0);
+  // Positions of the examples at the nodes of the current level, in
+  // increasing order.
+  vector<int> level_rows(n);
+  std::iota(level_rows.begin(), level_rows.end(), 0);
+  // Positions of the examples at the nodes of the current level whose
+  // value-to-weights vectors are not found by subtraction, in increasing order.
+  // The position in the level of the node of each, and its weight if it is
+  // positive or negative and otherwise zero, are copied next to it, so that
+  // the passes over the bins read them sequentially.
+  vector<int> scan_rows, scan_slots;
+  vector<Weight> scan_positive_weights, scan_negative_weights;
+  // If the bins do not visit all the scanned examples, scan_ks[i] is the
+  // index in scan_rows of the i-th example, or -1 if it is not scanned.
+  vector<int> scan_ks(Bins::kVisitsAllRows ? 0 : n, -1);
+  // num_node_examples[node_id] is the number of examples at node_id.
+  vector<int> num_node_examples(1, n);
+  // The value-to-weights vectors of the child of a split with more examples
+  // are its parent's minus its sibling's. If subtract_from[node_id] is not -1,
+  // node_id is such a child, and subtract_from[node_id] is its parent.
+  vector<NodeId> subtract_from(1, -1);
+  vector<vector<vector<pair<Weight, Weight>>>> all_value_to_weights(1);
+  NodeId level_begin = 0;
+  while (level_begin < static_cast<NodeId>(tree.size()) &&
+         tree[level_begin].depth < context.tree_depth) {
+    const NodeId level_end = tree.size();
+    for (NodeId node_id = level_begin; node_id < level_end; ++node_id) {
+      if (subtract_from[node_id] == -1) {
+        all_value_to_weights[node_id].resize(num_features);
+        for (Feature feature = 0; feature < num_features; ++feature) {
+          all_value_to_weights[node_id][feature].resize(
+              feature_index.values[feature].size());
+        }
+      }
+    }
+    // Branch-free, since the examples of scanned and subtracted nodes are
+    // interleaved.
+    scan_rows.resize(level_rows.size());
+    int num_scan_rows = 0;
+    for (int i : level_rows) {
+      scan_rows[num_scan_rows] = i;
+      num_scan_rows += (subtract_from[node_ids[i]] == -1);
+    }
+    scan_rows.resize(num_scan_rows);
+    scan_slots.resize(num_scan_rows);
+    scan_positive_weights.resize(num_scan_rows);
+    scan_negative_weights.resize(num_scan_rows);
+    for (int k = 0; k < num_scan_rows; ++k) {
+      const int i = scan_rows[k];
+      const bool positive = examples.labels[i] == 1;
+      scan_slots[k] = node_ids[i] - level_begin;
+      scan_positive_weights[k] = positive ? example_weights[i] : 0;
+      scan_negative_weights[k] = positive ? 0 : example_weights[i];
+      if (!Bins::kVisitsAllRows) scan_ks[i] = k;
+    }
+    ParallelFor(num_features, [&](int feature) {
+      // Number of examples of each node of the level visited by the bins.
+      vector<int> num_visited(level_end - level_begin, 0);
+      // The value-to-weights vector for feature of each node of the level.
+      vector<pair<Weight, Weight>*> level_value_to_weights(
+          level_end - level_begin, nullptr);
+      for (NodeId node_id = level_begin; node_id < level_end; ++node_id) {
+        if (subtract_from[node_id] == -1) {
+          level_value_to_weights[node_id - level_begin] =
+              all_value_to_weights[node_id][feature].data();
+        }
+      }
+      bins.ForEachBin(feature, scan_rows, scan_ks, [&](int k, int bin) {
+        const int slot = scan_slots[k];
+        if (!Bins::kVisitsAllRows) ++num_visited[slot];
+        pair<Weight, Weight>& weights = level_value_to_weights[slot][bin];
+        // Adding zero to the other weight leaves it the same, and avoids a
+        // branch on the label.
+        weights.first += scan_positive_weights[k];
+        weights.second += scan_negative_weights[k];
+      });
+      if (Bins::kVisitsAllRows) return;
+      for (NodeId node_id = level_begin; node_id < level_end; ++node_id) {
+        if (subtract_from[node_id] == -1) {
+          bins.AddZeroWeights(
+              feature, tree[node_id],
+              num_node_examples[node_id] - num_visited[node_id - level_begin],
+              &all_value_to_weights[node_id][feature]);
+        }
+      }
+    });
+    if (!Bins::kVisitsAllRows) {
+      for (int i : scan_rows) scan_ks[i] = -1;
+    }
+    for (NodeId node_id = level_begin; node_id < level_end; ++node_id) {
+      const NodeId parent_id = subtract_from[node_id];
+      if (parent_id == -1) continue;
+      const Node& parent = tree[parent_id];
+      const NodeId sibling_id = (parent.left_child_id == node_id)
+                                    ? parent.right_child_id
+                                    : parent.left_child_id;
+      all_value_to_weights[node_id].resize(num_features);
+      ParallelFor(num_features, [&](int feature) {
+        all_value_to_weights[node_id][feature] = SubtractValueToWeights(
+            all_value_to_weights[parent_id][feature],
+            all_value_to_weights[sibling_id][feature]);
+      });
+    }
+    // The previous level's vectors are no longer needed.
+    for (NodeId node_id = 0; node_id < level_begin; ++node_id) {
+      vector<vector<pair<Weight, Weight>>>().swap(
+          all_value_to_weights[node_id]);
+    }
+
+    // Search the nodes of the level in order, as TrainTreeByNode() would.
+    for (NodeId node_id = level_begin; node_id < level_end; ++node_id) {
+      Feature best_split_feature;
+      Value best_split_value;
+      const float best_delta_gradient =
+          BestSplit(context, all_value_to_weights[node_id], tree[node_id],
+                    tree.size(), &best_split_feature, &best_split_value);
+      if (best_delta_gradient <= kTolerance) continue;
+      Node child;
+      child.rows_begin = child.rows_end = 0;
+      child.positive_weight = child.negative_weight = 0;
+      child.leaf = true;
+      child.depth = tree[node_id].depth + 1;
+      Node& parent = tree[node_id];
+      parent.split_feature = best_split_feature;
+      parent.split_value = best_split_value;
+      parent.leaf = false;
+      parent.left_child_id = tree.size();
+      parent.right_child_id = tree.size() + 1;
+      tree.push_back(child);
+      tree.push_back(child);
+    }
+    num_node_examples.resize(tree.size(), 0);
+    subtract_from.resize(tree.size(), -1);
+    all_value_to_weights.resize(tree.size());
+
+    // Move the examples of the split nodes to their children, which are the
+    // nodes of the next level. The split of each node of the level is copied
+    // into a compact table, and the weights of the children are summed
+    // outside of the tree. The right child of a split is always next to the
+    // left child.
+    const int level_size = level_end - level_begin;
+    vector<Feature> split_features(level_size, 0);
+    vector<Value> split_values(level_size, 0);
+    vector<NodeId> left_child_ids(level_size, -1);
+    for (NodeId node_id = level_begin; node_id < level_end; ++node_id) {
+      const Node& node = tree[node_id];
+      if (node.leaf) continue;
+      split_features[node_id - level_begin] = node.split_feature;
+      split_values[node_id - level_begin] = node.split_value;
+      left_child_ids[node_id - level_begin] = node.left_child_id;
+    }
+    vector<pair<Weight, Weight>> child_weights(tree.size() - level_end);
+    int num_level_rows = 0;
+    for (int i : level_rows) {
+      const int slot = node_ids[i] - level_begin;
+      if (left_child_ids[slot] == -1) continue;  // Leaf.
+      const NodeId child_id =
+          left_child_ids[slot] +
+          !(bins.GetValue(split_features[slot], i) <= split_values[slot]);
+      node_ids[i] = child_id;
+      pair<Weight, Weight>& weights = child_weights[child_id - level_end];
+      const bool positive = examples.labels[i] == 1;
+      const Weight weight = example_weights[i];
+      weights.first += positive ? weight : 0;
+      weights.second += positive ? 0 : weight;
+      ++num_node_examples[child_id];
+      level_rows[num_level_rows++] = i;
+    }
+    level_rows.resize(num_level_rows);
+    const NodeId num_nodes = tree.size();
+    for (NodeId node_id = level_end; node_id < num_nodes; ++node_id) {
+      tree[node_id].positive_weight = child_weights[node_id - level_end].first;
+      tree[node_id].negative_weight = child_weights[node_id - level_end].second;
+    }
+    for (NodeId node_id = level_begin; node_id < level_end; ++node_id) {
+      const Node& node = tree[node_id];
+      if (node.leaf) continue;
+      if (num_node_examples[node.left_child_id] >
+          num_node_examples[node.right_child_id]) {
+        subtract_from[node.left_child_id] = node_id;
+      } else {
+        subtract_from[node.right_child_id] = node_id;
+      }
+    }
+    level_begin = level_end;
+  }
+  return tree;
+}
+
+namespace {
+
+// The value-to-weights vector of a node for one feature. If the node has far
+// fewer examples than the feature has values, only the ranks of the values of
+// its examples are kept.
+typedef struct NodeValueToWeights {
+  // Kept ranks, in increasing order, starting with rank 0. Empty if every rank
+  // is kept.
+  vector<int> ranks;
+  // If ranks is empty, weights[rank] is as returned by MakeValueToWeights().
+  // Otherwise weights[k] is the weights of rank ranks[k].
+  vector<pair<Weight, Weight>> weights;
+} NodeValueToWeights;
+
+}  // namespace
+
+// Return the value-to-weights vector of node for feature.
+static NodeValueToWeights MakeNodeValueToWeights(const TreeContext& context,
+                                                 const ExampleSet& examples,
+                                                 const vector<int>& rows,
+                                                 const Node& node,
+                                                 Feature feature) {
+  NodeValueToWeights value_to_weights;
+  const int num_rows = node.rows_end - node.rows_begin;
+  // Sorting the ranks of the examples costs more than scanning every rank,
+  // unless the examples are much fewer than the values.
+  if (4 * static_cast<size_t>(num_rows) >=
+      context.feature_index->values[feature].size()) {
+    value_to_weights.weights =
+        MakeValueToWeights(context, examples, rows, node, feature);
+    return value_to_weights;
+  }
+  const vector<int>& ranks = context.feature_index->ranks[feature];
+  const vector<Weight>& example_weights = *context.weights;
+  // Sorting by rank, then by position, sums the weights of each rank in the
+  // same order as MakeValueToWeights().
+  vector<uint64_t> keys(num_rows);
+  for (int i = node.rows_begin; i < node.rows_end; ++i) {
+    keys[i - node.rows_begin] =
+        (static_cast<uint64_t>(ranks[rows[i]]) << 32) | i;
+  }
+  std::sort(keys.begin(), keys.end());
+  value_to_weights.ranks.push_back(0);
+  value_to_weights.weights.emplace_back(0, 0);
+  for (const uint64_t key : keys) {
+    const int rank = key >> 32;
+    const int row = rows[static_cast<uint32_t>(key)];
+    if (rank != value_to_weights.ranks.back()) {
+      value_to_weights.ranks.push_back(rank);
+      value_to_weights.weights.emplace_back(0, 0);
+    }
+    pair<Weight, Weight>& weights = value_to_weights.weights.back();
+    if (examples.labels[row] == 1) {
+      weights.first += example_weights[row];
+    } else {  // label = -1
+      weights.second += example_weights[row];
+    }
+  }
+  return value_to_weights;
+}
+
+// Same as BestSplit(), given the value-to-weights vectors of node built by
+// MakeNodeValueToWeights(). The features are searched in parallel only if
+// parallel is true.
+static float BestNodeSplit(const TreeContext& context,
+                           const vector<NodeValueToWeights>& value_to_weights,
+                           const Node& node, int tree_size, bool parallel,
+                           Feature* best_split_feature,
+                           Value* best_split_value) {
+  const int num_features = context.num_features;
+  vector<Value> split_values(num_features);
+  vector<float> delta_gradients(num_features);
+  const std::function<void(int)> search = [&](int split_feature) {
+    const NodeValueToWeights& feature_value_to_weights =
+        value_to_weights[split_feature];
+    if (feature_value_to_weights.ranks.empty()) {
+      BestSplitValue(context, feature_value_to_weights.weights, split_feature,
+                     node, tree_size, &split_values[split_feature],
+                     &delta_gradients[split_feature]);
+      return;
+    }
+    const vector<int>& ranks = feature_value_to_weights.ranks;
+    const vector<pair<Weight, Weight>>& weights =
+        feature_value_to_weights.weights;
+    ScanSplitValues(
+        context, split_feature, node, tree_size, ranks.size(),
+        [&ranks](int k) { return ranks[k]; },
+        [&weights](int k) -> const pair<Weight, Weight>& {
+          return weights[k];
+        },
+        &split_values[split_feature], &delta_gradients[split_feature]);
+  };
+  if (parallel) {
+    ParallelFor(num_features, search);
+  } else {
     for (Feature split_feature = 0; split_feature < num_features;
          ++split_feature) {
-      const map<Value, pair<Weight, Weight>> value_to_weights =
-          MakeValueToWeightsMap(node, split_feature);
-      Value split_value;
-      float delta_gradient;
-      BestSplitValue(value_to_weights, node, tree.size(), &split_value,
-                     &delta_gradient);
-      if (delta_gradient > best_delta_gradient + kTolerance) {
-        best_delta_gradient = delta_gradient;
-        best_split_feature = split_feature;
-        best_split_value = split_value;
+      search(split_feature);
+    }
+  }
+  return PickBestSplit(split_values, delta_gradients, best_split_feature,
+                       best_split_value);
+}
+
+// Maximum number of examples times features of the nodes searched together by
+// TrainTreeByNode(), which bounds the size of their value-to-weights vectors.
+static const int64_t kMaxBatchSize = 1 << 20;
+
+// Version of TrainTree() for examples whose feature values are in columns.
+// Each node scans the ranks of its own examples for every feature. Without
+// bins the value-to-weights vectors can be as large as the data set, so they
+// are not kept for a whole level. Instead the nodes are taken in breadth-first
+// order, in batches of consecutive nodes whose examples are few enough, and
+// the value-to-weights vectors of a batch are built in parallel, one task per
+// node and feature. A batch of one large node is searched feature by feature,
+// and a batch of many small nodes node by node. The splits are then picked
+// one node at a time, in order, since the complexity penalty of a split
+// depends on the size of the tree when its node is searched, so the tree is
+// the same as if the nodes were searched serially.
+static Tree TrainTreeByNode(const TreeContext& context,
+                            const ExampleSet& examples) {
+  const FeatureIndex& feature_index = *context.feature_index;
+  const int num_features = context.num_features;
+  CHECK_EQ(feature_index.ranks.size(), num_features);
+  CHECK_EQ(feature_index.ranks[0].size(), examples.num_examples);
+  Tree tree;
+  vector<int> rows, scratch;
+  tree.push_back(MakeRootNode(context, examples, &rows));
+  vector<vector<NodeValueToWeights>> value_to_weights;
+  NodeId batch_begin = 0;
+  while (batch_begin < static_cast<NodeId>(tree.size())) {
+    // Nodes at maximum depth are never split, so they are not searched, and
+    // add nothing to the size of a batch.
+    NodeId batch_end = batch_begin;
+    int64_t batch_size = 0;
+    while (batch_end < static_cast<NodeId>(tree.size())) {
+      const Node& node = tree[batch_end];
+      const int64_t node_size =
+          (node.depth >= context.tree_depth)
+              ? 0
+              : static_cast<int64_t>(node.rows_end - node.rows_begin) *
+                    num_features;
+      if (batch_end > batch_begin && batch_size + node_size > kMaxBatchSize) {
+        break;
       }
+      batch_size += node_size;
+      ++batch_end;
     }
-    if (node.depth < FLAGS_tree_depth && best_delta_gradient > kTolerance) {
-      MakeChildNodes(best_split_feature, best_split_value, &node, &tree);
+    const int batch_length = batch_end - batch_begin;
+    value_to_weights.assign(batch_length,
+                            vector<NodeValueToWeights>(num_features));
+    ParallelFor(batch_length * num_features, [&](int task) {
+      const Node& node = tree[batch_begin + task / num_features];
+      if (node.depth >= context.tree_depth) return;
+      const Feature feature = task % num_features;
+      value_to_weights[task / num_features][feature] =
+          MakeNodeValueToWeights(context, examples, rows, node, feature);
+    });
+    for (NodeId node_id = batch_begin; node_id < batch_end; ++node_id) {
+      if (tree[node_id].depth >= context.tree_depth) continue;
+      Feature best_split_feature = -1;
+      Value best_split_value = 0;
+      const float best_delta_gradient = BestNodeSplit(
+          context, value_to_weights[node_id - batch_begin], tree[node_id],
+          tree.size(), batch_length == 1, &best_split_feature,
+          &best_split_value);
+      if (best_delta_gradient > kTolerance) {
+        MakeChildNodes(context, examples, best_split_feature,
+                       best_split_value, &tree[node_id], &rows, &scratch,
+                       &tree);
+      }
     }
-    ++node_id;
+    batch_begin = batch_end;
   }
   return tree;
 }
 
-Label ClassifyExample(const Example& example, const Tree& tree) {
+Tree TrainTree(const TreeContext& context, const ExampleSet& examples) {
+  CHECK_EQ(context.num_examples, examples.num_examples);
+  const FeatureIndex& feature_index = *context.feature_index;
+  if (feature_index.disk_columns != nullptr) {
+    return TrainTreeByLevel(context, examples, DiskBins(feature_index));
+  }
+  if (IsSparse(examples)) {
+    return TrainTreeByLevel(context, examples,
+                            SparseBins(feature_index, examples.sparse_rows));
+  }
+  if (feature_index.max_bins > 0) {
+    CHECK_EQ(feature_index.ranks.size(), context.num_features);
+    return TrainTreeByLevel(context, examples,
+                            DenseBins(feature_index, examples));
+  }
+  return TrainTreeByNode(context, examples);
+}
+
+FrozenTree FreezeTree(const Tree& tree) {
+  const NodeId num_nodes = tree.size();
+  FrozenTree frozen_tree(num_nodes);
+  for (NodeId node_id = 0; node_id < num_nodes; ++node_id) {
+    const Node& node = tree[node_id];
+    FrozenNode& frozen_node = frozen_tree[node_id];
+    frozen_node.leaf = node.leaf;
+    if (node.leaf) {
+      if (node.positive_weight >= node.negative_weight) {
+        frozen_node.label = 1;
+      } else {
+        frozen_node.label = -1;
+      }
+    } else {
+      frozen_node.split_feature = node.split_feature;
+      frozen_node.split_value = node.split_value;
+      frozen_node.left_child_id = node.left_child_id;
+      frozen_node.right_child_id = node.right_child_id;
+    }
+  }
+  return frozen_tree;
+}
+
+Label ClassifyExample(const Example& example, const FrozenTree& tree) {
   CHECK_GE(tree.size(), 1);
-  const Node* node = &tree[0];
+  const FrozenNode* node = &tree[0];
   while (node->leaf == false) {
     if (example.values[node->split_feature] <= node->split_value) {
       node = &tree[node->left_child_id];
@@ -169,43 +1047,90 @@ Label ClassifyExample(const Example& example, const Tree& tree) {
       node = &tree[node->right_child_id];
     }
   }
-  if (node->positive_weight >= node->negative_weight) {
-    return 1;
-  } else {
-    return -1;
+  return node->label;
+}
+
+Label ClassifyExample(const ExampleSet& examples, int i,
+                      const FrozenTree& tree) {
+  CHECK_GE(tree.size(), 1);
+  const FrozenNode* node = &tree[0];
+  while (node->leaf == false) {
+    if (ExampleValue(examples, i, node->split_feature) <= node->split_value) {
+      node = &tree[node->left_child_id];
+    } else {
+      node = &tree[node->right_child_id];
+    }
   }
+  return node->label;
 }
 
-float Gradient(float wgtd_error, int tree_size, float alpha, int sign_edge) {
-  // TODO(usyed): Can we make some mild assumptions and get rid of sign_edge?
-  const float complexity_penalty = ComplexityPenalty(tree_size);
-  const float edge = wgtd_error - 0.5;
-  const int sign_alpha = (alpha >= 0) ? 1 : -1;
-  if (fabs(alpha) > kTolerance) {
-    return edge + sign_alpha * complexity_penalty;
-  } else if (fabs(edge) <= complexity_penalty) {
-    return 0;
-  } else {
-    return edge - sign_edge * complexity_penalty;
+float Gradient(const TreeContext& context, float wgtd_error, int tree_size,
+               float alpha, int sign_edge) {
+  return GradientWithPenalty(wgtd_error, ComplexityPenalty(context, tree_size),
+                             alpha, sign_edge);
+}
+
+float EvaluateTreeWgtd(const TreeContext& context, const ExampleSet& examples,
+                       const FrozenTree& tree) {
+  float wgtd_error = 0;
+  for (int i = 0; i < examples.num_examples; ++i) {
+    if (ClassifyExample(examples, i, tree) != examples.labels[i]) {
+      wgtd_error += (*context.weights)[i];
+    }
+  }
+  return wgtd_error * context.weight_scale;
+}
+
+// Classify the i-th example on disk in columns with tree.
+static Label ClassifyDiskExample(const DiskColumns& columns, int i,
+                                 const FrozenTree& tree) {
+  const FrozenNode* node = &tree[0];
+  while (node->leaf == false) {
+    if (DiskValue(columns, node->split_feature, i) <= node->split_value) {
+      node = &tree[node->left_child_id];
+    } else {
+      node = &tree[node->right_child_id];
+    }
+  }
+  return node->label;
+}
+
+vector<uint64_t> MakeMistakes(const TreeContext& context,
+                              const ExampleSet& examples,
+                              const FrozenTree& tree) {
+  const DiskColumns* disk_columns = context.feature_index->disk_columns;
+  vector<uint64_t> mistakes((examples.num_examples + 63) / 64, 0);
+  for (int i = 0; i < examples.num_examples; ++i) {
+    const Label label = (disk_columns != nullptr)
+                            ? ClassifyDiskExample(*disk_columns, i, tree)
+                            : ClassifyExample(examples, i, tree);
+    if (label != examples.labels[i]) {
+      mistakes[i / 64] |= static_cast<uint64_t>(1) << (i % 64);
+    }
   }
+  return mistakes;
 }
 
-float EvaluateTreeWgtd(const vector<Example>& examples, const Tree& tree) {
+float EvaluateMistakesWgtd(const TreeContext& context,
+                           const vector<uint64_t>& mistakes) {
+  const vector<Weight>& weights = *context.weights;
   float wgtd_error = 0;
-  for (const Example& example : examples) {
-    if (ClassifyExample(example, tree) != example.label) {
-      wgtd_error += example.weight;
+  // Adding the weights of the misclassified examples in order gives the same
+  // sum as adding every weight times its mistake bit, with fewer additions.
+  for (size_t word = 0; word < mistakes.size(); ++word) {
+    for (uint64_t bits = mistakes[word]; bits != 0; bits &= bits - 1) {
+      wgtd_error += weights[64 * word + __builtin_ctzll(bits)];
     }
   }
-  return wgtd_error;
+  return wgtd_error * context.weight_scale;
 }
 
-float ComplexityPenalty(int tree_size) {
-  CHECK(is_initialized);
-  float rademacher =
-      sqrt(((2 * tree_size + 1) * (log(num_features + 2) / log(2)) *
-            log(num_examples)) /
-           num_examples);
-  return ((FLAGS_lambda * rademacher + FLAGS_beta) * num_examples) /
-         (2 * the_normalizer);
+float ComplexityPenalty(const TreeContext& context, int tree_size) {
+  const float rademacher =
+      (tree_size < static_cast<int>(context.rademacher.size()))
+          ? context.rademacher[tree_size]
+          : Rademacher(context, tree_size);
+  return ((context.lambda * rademacher + context.beta) *
+          context.num_examples) /
+         (2 * context.normalizer);
 }
@@ -17,53 +17,155 @@ limitations under the License.
 #ifndef TREE_H_
 #define TREE_H_
 
-#include "types.h"
-
-// Initialize some global variables.
-void InitializeTreeData(const vector<Example>& examples, float normalizer);
+#include <stdint.h>
 
-// Return root node for a tree.
-Node MakeRootNode(const vector<Example>& examples);
+#include "types.h"
 
-// Return a tree trained on examples.
-Tree TrainTree(const vector<Example>& examples);
+// In this file, the examples a tree is trained on are the examples of an
+// ExampleSet, and the i-th example is the one at position i in the set.
+
+// The state a tree is trained with: the hyperparameters of the model being
+// trained, and the examples' feature index and current weights. Nothing else is
+// shared between calls, so several models can be trained at the same time,
+// each with its own context, on the same examples and feature index.
+typedef struct TreeContext {
+  double beta;  // beta parameter for gradient.
+  double lambda;  // lambda parameter for gradient.
+  int tree_depth;  // Maximum depth of a tree. The root node has depth 0.
+  const FeatureIndex* feature_index;  // Feature index of the examples.
+  // The current weight of the i-th example is (*weights)[i] * weight_scale.
+  // The weights are kept unnormalized, so that they are not rescaled in a
+  // separate pass after each update.
+  const vector<Weight>* weights;
+  float weight_scale;
+  int num_examples;  // Number of examples.
+  int num_features;  // Number of features.
+  float normalizer;  // Normalizer of the weights.
+  // rademacher[tree_size] is the Rademacher complexity term of
+  // ComplexityPenalty() for a tree of tree_size nodes, for each size a tree can
+  // reach.
+  vector<float> rademacher;
+} TreeContext;
+
+// Point context to index and weights, which must outlive it, with a weight
+// scale of 1, and set its sizes from examples. The tree depth of context must
+// already be set, and the other hyperparameters and the normalizer are left to
+// the caller.
+void InitializeTreeContext(const ExampleSet& examples,
+                           const FeatureIndex& index,
+                           const vector<Weight>& weights,
+                           TreeContext* context);
+
+// Return the feature index for the set of examples, used by TrainTree(). It is
+// built once per data set, and can be shared by several models. If --max_bins
+// is positive, the values of each feature are grouped into at most that many
+// bins, each containing roughly the same number of examples. If the feature
+// values of examples are in sparse rows, trees are trained one level at a
+// time, and the split search for a feature only visits the examples with a
+// stored value of the feature. The weights of the other examples at a node are
+// found from the node's total weights. Sparse rows require --max_bins > 0.
+FeatureIndex MakeFeatureIndex(const ExampleSet& examples);
+
+// Return the feature index for training examples whose feature values are
+// read from columns, instead of from the example set, which then only needs
+// labels. Trees are trained one level at a time by streaming over the columns,
+// so the feature values do not have to fit in memory. Requires
+// --max_bins > 0. columns must outlive the index.
+FeatureIndex MakeDiskFeatureIndex(const DiskColumns* columns);
+
+// Return the value of feature in row of rows.
+Value SparseValue(const SparseRows& rows, int row, Feature feature);
+
+// Return the value of feature for the i-th example of examples, whose feature
+// values are either in columns or in sparse rows.
+Value ExampleValue(const ExampleSet& examples, int i, Feature feature);
+
+// Return root node for a tree. Also set rows to the positions of all examples,
+// in order. While a tree is trained, its nodes refer to their examples by
+// ranges of rows, and rows is partitioned in place each time a node is split.
+Node MakeRootNode(const TreeContext& context, const ExampleSet& examples,
+                  vector<int>* rows);
+
+// Return a tree trained on examples with context. If the feature index of
+// context was built with a positive --max_bins, or the feature values of
+// examples are not in columns, the tree is grown one level at a time: one
+// sequential pass over the bins of each feature finds the weights of all the
+// nodes of a level. Otherwise each node scans its own
+// examples, and batches of small nodes are searched in parallel. Either way
+// the tree does not depend on the number of threads.
+Tree TrainTree(const TreeContext& context, const ExampleSet& examples);
 
 // Make child nodes using split feature/value and add them to the tree. Also
-// update info in the parent node, like child pointers.
-void MakeChildNodes(Feature split_feature, Value split_value, Node* parent,
-                    Tree* tree);
-
-// Return a map from each value of feature to a pair of weights. The first
-// weight in the pair is the total weight of positive examples at node that have
-// that value for feature, and the second weight in the pair is the total weight
-// of negative examples at node that have that value for feature. This map is
-// used to determine the best split feature/value.
-map<Value, pair<Weight, Weight>> MakeValueToWeightsMap(const Node& node,
-                                                       Feature feature);
-
-// Given a value-to-weights map for a feature (constructed by
-// MakeValueToWeightsMap()), determine the best split value for the feature and
-// the improvement in the gradient of the objective if we split on that value.
-// Note that delta_gradient <= 0 indicates that we should not split on this
-// feature.
-void BestSplitValue(const map<Value, pair<Weight, Weight>>& value_to_weights,
-                    const Node& node, int tree_size, Value* split_value,
-                    float* delta_gradient);
+// update info in the parent node, like child pointers. The parent's range of
+// rows is partitioned so that the rows of the left child come first, and both
+// children keep their rows in their original order. The rows of the right
+// child are set aside in scratch while the rows are partitioned. scratch grows
+// to the number of rows of parent if it is smaller, so a single buffer passed
+// to every split of a tree is only allocated once, for the root. The feature
+// values of examples must be in columns, and the feature index of context must
+// have the ranks of examples.
+void MakeChildNodes(const TreeContext& context, const ExampleSet& examples,
+                    Feature split_feature, Value split_value, Node* parent,
+                    vector<int>* rows, vector<int>* scratch, Tree* tree);
+
+// Return a vector that maps the rank of each value of feature in the feature
+// index to a pair of weights. The first weight in the pair is the total weight
+// of positive examples at node that have that value for feature, and the second
+// weight in the pair is the total weight of negative examples at node that have
+// that value for feature. This vector is used to determine the best split
+// feature/value. The feature index of context must have the ranks of examples.
+vector<pair<Weight, Weight>> MakeValueToWeights(const TreeContext& context,
+                                                const ExampleSet& examples,
+                                                const vector<int>& rows,
+                                                const Node& node,
+                                                Feature feature);
+
+// Given the value-to-weights vector for a feature (constructed by
+// MakeValueToWeights()), determine the best split value for the feature and the
+// improvement in the gradient of the objective if we split on that value. Note
+// that delta_gradient <= 0 indicates that we should not split on this feature.
+void BestSplitValue(const TreeContext& context,
+                    const vector<pair<Weight, Weight>>& value_to_weights,
+                    Feature feature, const Node& node, int tree_size,
+                    Value* split_value, float* delta_gradient);
+
+// Return a frozen copy of a trained tree, to be stored in a model. Each leaf
+// is labeled with the label of the larger total weight of examples at it.
+FrozenTree FreezeTree(const Tree& tree);
 
 // Given an example and a tree, classify the example with the tree.
 // NB: This function assumes that if an example has a feature value that is
 // _less than or equal to_ a node's split value then the example should be sent
 // to the left child, and otherwise sent to the right child.
-Label ClassifyExample(const Example& example, const Tree& tree);
+Label ClassifyExample(const Example& example, const FrozenTree& tree);
+
+// Same as ClassifyExample(), for the i-th example of examples, whose feature
+// values are either in columns or in sparse rows.
+Label ClassifyExample(const ExampleSet& examples, int i,
+                      const FrozenTree& tree);
 
 // Return the (sub)gradient of the objective with respect to a tree.
-float Gradient(float wgtd_error, int tree_size, float alpha, int sign_edge);
+float Gradient(const TreeContext& context, float wgtd_error, int tree_size,
+               float alpha, int sign_edge);
 
 // Given a set of examples and a tree, return the weighted error of tree on
 // the examples.
-float EvaluateTreeWgtd(const vector<Example>& examples, const Tree& tree);
+float EvaluateTreeWgtd(const TreeContext& context, const ExampleSet& examples,
+                       const FrozenTree& tree);
+
+// Return a packed bit vector whose i-th bit is set if tree misclassifies the
+// i-th example of examples. Since a tree's predictions on a fixed set of
+// examples never change, this can be computed once per tree and reused.
+vector<uint64_t> MakeMistakes(const TreeContext& context,
+                              const ExampleSet& examples,
+                              const FrozenTree& tree);
+
+// Given the mistakes of a tree on the examples of context (constructed by
+// MakeMistakes()), return the weighted error of the tree on the examples.
+float EvaluateMistakesWgtd(const TreeContext& context,
+                           const vector<uint64_t>& mistakes);
 
 // Return complexity penalty.
-float ComplexityPenalty(int tree_size);
+float ComplexityPenalty(const TreeContext& context, int tree_size);
 
 #endif  // TREE_H_
@@ -17,98 +17,200 @@ limitations under the License.
 #include "srm_test.h"
 #include "tree.h"
 
+#include <cmath>
+#include <random>
+
 #include "gflags/gflags.h"
 #include "gtest/gtest.h"
 
-DECLARE_int32(tree_depth);
-DECLARE_double(beta);
-DECLARE_double(lambda);
+DECLARE_int32(max_bins);
+DECLARE_int32(num_threads);
 
 class TreeTest : public SrmTest {
  protected:
   virtual void SetUp() {
     SrmTest::SetUp();
-    InitializeTreeData(examples_, examples_.size());
+    feature_index_ = MakeFeatureIndex(example_set_);
+    context_.beta = 0;
+    context_.lambda = 0;
+    context_.tree_depth = 1;
+    InitializeTreeContext(example_set_, feature_index_, example_set_.weights,
+                          &context_);
+    context_.normalizer = examples_.size();
   }
+
+  FeatureIndex feature_index_;  // Feature index of example_set_.
+  TreeContext context_;  // Context for training on example_set_.
 };
 
+TEST_F(TreeTest, TestMakeFeatureIndex) {
+  FeatureIndex index = MakeFeatureIndex(example_set_);
+  EXPECT_EQ(3, index.values.size());
+  EXPECT_EQ(3, index.ranks.size());
+
+  // All values of first feature are distinct
+  vector<Value> values_for_0 = {1.0, 2.0, 3.0, 4.0, 5.0};
+  vector<int> ranks_for_0 = {0, 2, 4, 1, 3};
+  EXPECT_EQ(values_for_0.size(), index.values[0].size());
+  for (size_t i = 0; i < values_for_0.size(); ++i) {
+    EXPECT_NEAR(values_for_0[i], index.values[0][i], kTolerance);
+  }
+  EXPECT_EQ(ranks_for_0, index.ranks[0]);
+
+  // Third feature has only two distinct values
+  vector<Value> values_for_2 = {11.0, 22.0};
+  vector<int> ranks_for_2 = {0, 0, 0, 1, 0};
+  EXPECT_EQ(values_for_2.size(), index.values[2].size());
+  for (size_t i = 0; i < values_for_2.size(); ++i) {
+    EXPECT_NEAR(values_for_2[i], index.values[2][i], kTolerance);
+  }
+  EXPECT_EQ(ranks_for_2, index.ranks[2]);
+}
+
+TEST_F(TreeTest, TestMakeFeatureIndexWithBins) {
+  FLAGS_max_bins = 2;
+  FeatureIndex index = MakeFeatureIndex(example_set_);
+  FLAGS_max_bins = 0;
+
+  // Five distinct values are merged into two bins
+  vector<Value> values_for_0 = {3.0, 5.0};
+  vector<int> ranks_for_0 = {0, 0, 1, 0, 1};
+  EXPECT_EQ(values_for_0.size(), index.values[0].size());
+  for (size_t i = 0; i < values_for_0.size(); ++i) {
+    EXPECT_NEAR(values_for_0[i], index.values[0][i], kTolerance);
+  }
+  EXPECT_EQ(ranks_for_0, index.ranks[0]);
+
+  // Two distinct values fit in two bins
+  vector<Value> values_for_2 = {11.0, 22.0};
+  vector<int> ranks_for_2 = {0, 0, 0, 1, 0};
+  EXPECT_EQ(values_for_2.size(), index.values[2].size());
+  for (size_t i = 0; i < values_for_2.size(); ++i) {
+    EXPECT_NEAR(values_for_2[i], index.values[2][i], kTolerance);
+  }
+  EXPECT_EQ(ranks_for_2, index.ranks[2]);
+}
+
 TEST_F(TreeTest, TestMakeRootNode) {
-  Node root = MakeRootNode(examples_);
-  EXPECT_EQ(5, root.examples.size());
+  vector<int> rows;
+  Node root = MakeRootNode(context_, example_set_, &rows);
+  EXPECT_EQ(0, root.rows_begin);
+  EXPECT_EQ(5, root.rows_end);
+  vector<int> expected_rows = {0, 1, 2, 3, 4};
+  EXPECT_EQ(expected_rows, rows);
   EXPECT_NEAR(0.6, root.positive_weight, kTolerance);
   EXPECT_NEAR(0.4, root.negative_weight, kTolerance);
   EXPECT_TRUE(root.leaf);
   EXPECT_EQ(0, root.depth);
 }
 
-TEST_F(TreeTest, TestMakeValueToWeightsMap) {
-  Node root = MakeRootNode(examples_);
-  map<Value, pair<Weight, Weight>> value_to_weights;
+TEST_F(TreeTest, TestMakeRootNodeSubset) {
+  vector<int> rows;
+  const ExampleSet examples =
+      MakeExampleSet({examples_[1], examples_[3], examples_[4]});
+  const FeatureIndex index = MakeFeatureIndex(examples);
+  TreeContext context;
+  context.tree_depth = 1;
+  InitializeTreeContext(examples, index, examples.weights, &context);
+  Node root = MakeRootNode(context, examples, &rows);
+  EXPECT_EQ(0, root.rows_begin);
+  EXPECT_EQ(3, root.rows_end);
+  vector<int> expected_rows = {0, 1, 2};
+  EXPECT_EQ(expected_rows, rows);
+  EXPECT_NEAR(0.2, root.positive_weight, kTolerance);
+  EXPECT_NEAR(0.4, root.negative_weight, kTolerance);
+}
+
+TEST_F(TreeTest, TestMakeValueToWeights) {
+  vector<int> rows, scratch;
+  Node root = MakeRootNode(context_, example_set_, &rows);
+  vector<pair<Weight, Weight>> value_to_weights;
 
   // Sort by first feature
-  value_to_weights = MakeValueToWeightsMap(root, 0);
-  vector<Value> values_for_0 = {1.0, 2.0, 3.0, 4.0, 5.0};
+  value_to_weights = MakeValueToWeights(context_, example_set_, rows, root, 0);
   vector<Weight> positive_weights_for_0 = {0.2, 0.0, 0.2, 0.0, 0.2};
   vector<Weight> negative_weights_for_0 = {0.0, 0.2, 0.0, 0.2, 0.0};
-  int i = 0;
-  for (const pair<Value, pair<Weight, Weight>>& elem : value_to_weights) {
-    EXPECT_NEAR(values_for_0[i], elem.first, kTolerance);
-    EXPECT_NEAR(positive_weights_for_0[i], elem.second.first, kTolerance);
-    EXPECT_NEAR(negative_weights_for_0[i], elem.second.second, kTolerance);
-    ++i;
+  EXPECT_EQ(5, value_to_weights.size());
+  for (size_t i = 0; i < value_to_weights.size(); ++i) {
+    EXPECT_NEAR(positive_weights_for_0[i], value_to_weights[i].first,
+                kTolerance);
+    EXPECT_NEAR(negative_weights_for_0[i], value_to_weights[i].second,
+                kTolerance);
   }
 
   // Sort by second feature
-  value_to_weights = MakeValueToWeightsMap(root, 1);
-  vector<Value> values_for_1 = {0.1, 0.2, 0.3, 0.4, 0.5};
+  value_to_weights = MakeValueToWeights(context_, example_set_, rows, root, 1);
   vector<Weight> positive_weights_for_1 = {0.2, 0.0, 0.2, 0.2, 0.0};
   vector<Weight> negative_weights_for_1 = {0.0, 0.2, 0.0, 0.0, 0.2};
-  i = 0;
-  for (const pair<Value, pair<Weight, Weight>>& elem : value_to_weights) {
-    EXPECT_NEAR(values_for_1[i], elem.first, kTolerance);
-    EXPECT_NEAR(positive_weights_for_1[i], elem.second.first, kTolerance);
-    EXPECT_NEAR(negative_weights_for_1[i], elem.second.second, kTolerance);
-    ++i;
+  EXPECT_EQ(5, value_to_weights.size());
+  for (size_t i = 0; i < value_to_weights.size(); ++i) {
+    EXPECT_NEAR(positive_weights_for_1[i], value_to_weights[i].first,
+                kTolerance);
+    EXPECT_NEAR(negative_weights_for_1[i], value_to_weights[i].second,
+                kTolerance);
   }
+
+  // Only examples at the node are counted
+  Tree tree;
+  tree.push_back(root);
+  MakeChildNodes(context_, example_set_, 1, 0.4, &tree[0], &rows, &scratch,
+                 &tree);
+  value_to_weights =
+      MakeValueToWeights(context_, example_set_, rows, tree[2], 1);
+  EXPECT_EQ(5, value_to_weights.size());
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_NEAR(0.0, value_to_weights[i].first, kTolerance);
+    EXPECT_NEAR(0.0, value_to_weights[i].second, kTolerance);
+  }
+  EXPECT_NEAR(0.0, value_to_weights[4].first, kTolerance);
+  EXPECT_NEAR(0.2, value_to_weights[4].second, kTolerance);
 }
 
 TEST_F(TreeTest, TestBestSplitValue) {
-  Node root = MakeRootNode(examples_);
-  map<Value, pair<Weight, Weight>> value_to_weights;
+  vector<int> rows;
+  Node root = MakeRootNode(context_, example_set_, &rows);
+  vector<pair<Weight, Weight>> value_to_weights;
   Value split_value;
   float delta_gradient;
 
-  FLAGS_tree_depth = 1;
-  FLAGS_lambda = 0;
-  FLAGS_beta = 0;
+  context_.tree_depth = 1;
+  context_.lambda = 0;
+  context_.beta = 0;
 
   // Split on first feature, which is useless.
-  value_to_weights = MakeValueToWeightsMap(root, 0);
-  BestSplitValue(value_to_weights, root, 1, &split_value, &delta_gradient);
+  value_to_weights = MakeValueToWeights(context_, example_set_, rows, root, 0);
+  BestSplitValue(context_, value_to_weights, 0, root, 1, &split_value,
+                 &delta_gradient);
   EXPECT_NEAR(0, delta_gradient, kTolerance);
 
   // Split on second feature, which is useful.
-  value_to_weights = MakeValueToWeightsMap(root, 1);
-  BestSplitValue(value_to_weights, root, 1, &split_value, &delta_gradient);
+  value_to_weights = MakeValueToWeights(context_, example_set_, rows, root, 1);
+  BestSplitValue(context_, value_to_weights, 1, root, 1, &split_value,
+                 &delta_gradient);
   EXPECT_NEAR(0.2, delta_gradient, kTolerance);
   EXPECT_NEAR(0.4, split_value, kTolerance);
 
   // Don't split on second feature if complexity penalty is very high.
-  FLAGS_lambda = 100;
-  value_to_weights = MakeValueToWeightsMap(root, 1);
-  BestSplitValue(value_to_weights, root, 1, &split_value, &delta_gradient);
+  context_.lambda = 100;
+  value_to_weights = MakeValueToWeights(context_, example_set_, rows, root, 1);
+  BestSplitValue(context_, value_to_weights, 1, root, 1, &split_value,
+                 &delta_gradient);
   EXPECT_NEAR(delta_gradient, 0, kTolerance);
 }
 
 TEST_F(TreeTest, TestMakeChildNodes) {
-  Node root = MakeRootNode(examples_);
+  vector<int> rows, scratch;
   Tree tree;
 
-  tree.push_back(root);
-  MakeChildNodes(0, 3.0, &tree[0], &tree);
+  tree.push_back(MakeRootNode(context_, example_set_, &rows));
+  MakeChildNodes(context_, example_set_, 0, 3.0, &tree[0], &rows, &scratch,
+                 &tree);
   EXPECT_EQ(3, tree.size());
+  vector<int> expected_rows = {0, 1, 3, 2, 4};
+  EXPECT_EQ(expected_rows, rows);
   // Check root node
-  EXPECT_EQ(5, tree[0].examples.size());
+  EXPECT_EQ(0, tree[0].rows_begin);
+  EXPECT_EQ(5, tree[0].rows_end);
   EXPECT_EQ(0, tree[0].split_feature);
   EXPECT_EQ(1, tree[0].left_child_id);
   EXPECT_EQ(2, tree[0].right_child_id);
@@ -118,24 +220,30 @@ TEST_F(TreeTest, TestMakeChildNodes) {
   EXPECT_FALSE(tree[0].leaf);
   EXPECT_EQ(0, tree[0].depth);
   // Check left child node
-  EXPECT_EQ(3, tree[1].examples.size());
+  EXPECT_EQ(0, tree[1].rows_begin);
+  EXPECT_EQ(3, tree[1].rows_end);
   EXPECT_NEAR(0.4, tree[1].positive_weight, kTolerance);
   EXPECT_NEAR(0.2, tree[1].negative_weight, kTolerance);
   EXPECT_TRUE(tree[1].leaf);
   EXPECT_EQ(1, tree[1].depth);
   // Check right child node
-  EXPECT_EQ(2, tree[2].examples.size());
+  EXPECT_EQ(3, tree[2].rows_begin);
+  EXPECT_EQ(5, tree[2].rows_end);
   EXPECT_NEAR(0.2, tree[2].positive_weight, kTolerance);
   EXPECT_NEAR(0.2, tree[2].negative_weight, kTolerance);
   EXPECT_TRUE(tree[2].leaf);
   EXPECT_EQ(1, tree[2].depth);
 
   tree.clear();
-  tree.push_back(root);
-  MakeChildNodes(1, 0.4, &tree[0], &tree);
+  tree.push_back(MakeRootNode(context_, example_set_, &rows));
+  MakeChildNodes(context_, example_set_, 1, 0.4, &tree[0], &rows, &scratch,
+                 &tree);
   EXPECT_EQ(3, tree.size());
+  expected_rows = {0, 1, 2, 3, 4};
+  EXPECT_EQ(expected_rows, rows);
   // Check root node
-  EXPECT_EQ(5, tree[0].examples.size());
+  EXPECT_EQ(0, tree[0].rows_begin);
+  EXPECT_EQ(5, tree[0].rows_end);
   EXPECT_EQ(1, tree[0].split_feature);
   EXPECT_NEAR(0.4, tree[0].split_value, kTolerance);
   EXPECT_EQ(1, tree[0].left_child_id);
@@ -145,13 +253,15 @@ TEST_F(TreeTest, TestMakeChildNodes) {
   EXPECT_FALSE(tree[0].leaf);
   EXPECT_EQ(0, tree[0].depth);
   // Check left child node
-  EXPECT_EQ(4, tree[1].examples.size());
+  EXPECT_EQ(0, tree[1].rows_begin);
+  EXPECT_EQ(4, tree[1].rows_end);
   EXPECT_NEAR(0.6, tree[1].positive_weight, kTolerance);
   EXPECT_NEAR(0.2, tree[1].negative_weight, kTolerance);
   EXPECT_TRUE(tree[1].leaf);
   EXPECT_EQ(1, tree[1].depth);
   // Check right child node
-  EXPECT_EQ(1, tree[2].examples.size());
+  EXPECT_EQ(4, tree[2].rows_begin);
+  EXPECT_EQ(5, tree[2].rows_end);
   EXPECT_NEAR(0.0, tree[2].positive_weight, kTolerance);
   EXPECT_NEAR(0.2, tree[2].negative_weight, kTolerance);
   EXPECT_TRUE(tree[2].leaf);
@@ -159,15 +269,15 @@ TEST_F(TreeTest, TestMakeChildNodes) {
 }
 
 TEST_F(TreeTest, TestTrainTree) {
-  FLAGS_beta = 0;
-  FLAGS_lambda = 0;
+  context_.beta = 0;
+  context_.lambda = 0;
 
-  FLAGS_tree_depth = 1;
-  Tree tree = TrainTree(examples_);
+  context_.tree_depth = 1;
+  Tree tree = TrainTree(context_, example_set_);
   EXPECT_EQ(3, tree.size());
 
-  FLAGS_tree_depth = 2;
-  tree = TrainTree(examples_);
+  context_.tree_depth = 2;
+  tree = TrainTree(context_, example_set_);
   EXPECT_EQ(5, tree.size());
 
   // Check all the nodes
@@ -206,65 +316,367 @@ TEST_F(TreeTest, TestTrainTree) {
   EXPECT_EQ(2, tree[4].depth);
 
   // Very high complexity penalty causes tree to never split
-  FLAGS_lambda = 100;
-  tree = TrainTree(examples_);
+  context_.lambda = 100;
+  tree = TrainTree(context_, example_set_);
   EXPECT_EQ(1, tree.size());
 }
 
+TEST_F(TreeTest, TestTrainTreeWithBins) {
+  context_.beta = 0;
+  context_.lambda = 0;
+  context_.tree_depth = 2;
+  FLAGS_max_bins = 3;
+  const FeatureIndex index = MakeFeatureIndex(example_set_);
+  FLAGS_max_bins = 0;
+  // The index keeps its bins, so the flag no longer matters.
+  context_.feature_index = &index;
+  Tree tree = TrainTree(context_, example_set_);
+
+  // Splits of the exact tree fall on bin boundaries, so the trees are the same.
+  // The value-to-weights vectors of node 1 are found by subtracting those of
+  // node 2 from those of node 0.
+  EXPECT_EQ(5, tree.size());
+  EXPECT_EQ(1, tree[0].split_feature);
+  EXPECT_NEAR(0.4, tree[0].split_value, kTolerance);
+  EXPECT_FALSE(tree[0].leaf);
+  EXPECT_EQ(2, tree[1].split_feature);
+  EXPECT_NEAR(11.0, tree[1].split_value, kTolerance);
+  EXPECT_FALSE(tree[1].leaf);
+  EXPECT_TRUE(tree[2].leaf);
+  EXPECT_NEAR(0.6, tree[3].positive_weight, kTolerance);
+  EXPECT_NEAR(0.0, tree[3].negative_weight, kTolerance);
+  EXPECT_TRUE(tree[3].leaf);
+  EXPECT_NEAR(0.0, tree[4].positive_weight, kTolerance);
+  EXPECT_NEAR(0.2, tree[4].negative_weight, kTolerance);
+  EXPECT_TRUE(tree[4].leaf);
+}
+
+TEST_F(TreeTest, TestTrainTreeMultiThreaded) {
+  context_.beta = 0;
+  context_.lambda = 0;
+  context_.tree_depth = 2;
+  Tree serial_tree = TrainTree(context_, example_set_);
+  FLAGS_num_threads = 4;
+  Tree parallel_tree = TrainTree(context_, example_set_);
+  FLAGS_num_threads = 1;
+  ExpectSameTree(serial_tree, parallel_tree);
+}
+
+TEST_F(TreeTest, TestTrainTreeOnDisk) {
+  context_.beta = 0;
+  context_.lambda = 0;
+  context_.tree_depth = 4;
+  FLAGS_max_bins = 8;
+  // A larger data set with noisy labels and non-uniform weights, so that the
+  // tree has several levels.
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> dist;
+  vector<Example> examples(200);
+  for (Example& example : examples) {
+    example.values = {dist(rng), dist(rng), dist(rng)};
+    example.label =
+        (example.values[0] + example.values[1] * example.values[2] +
+         0.3 * dist(rng) > 0.8) ? 1 : -1;
+    example.weight = dist(rng) / examples.size();
+  }
+  // Train on every other example, and store the columns of all of them.
+  vector<Example> train_examples;
+  DiskColumns columns;
+  columns.num_file_rows = examples.size();
+  columns.num_features = 3;
+  vector<Value> values(3 * examples.size());
+  for (size_t i = 0; i < examples.size(); ++i) {
+    for (Feature j = 0; j < 3; ++j) {
+      values[j * examples.size() + i] = examples[i].values[j];
+    }
+    if (i % 2 == 0) {
+      train_examples.push_back(examples[i]);
+      columns.rows.push_back(i);
+    }
+  }
+  columns.values = values.data();
+  ExampleSet train = MakeExampleSet(train_examples);
+  const FeatureIndex index = MakeFeatureIndex(train);
+  TreeContext context = context_;
+  InitializeTreeContext(train, index, train.weights, &context);
+  context.normalizer = 1;
+  Tree tree = TrainTree(context, train);
+  vector<uint64_t> mistakes = MakeMistakes(context, train, FreezeTree(tree));
+  train.values.clear();
+  const FeatureIndex disk_index = MakeDiskFeatureIndex(&columns);
+  InitializeTreeContext(train, disk_index, train.weights, &context);
+  Tree disk_tree = TrainTree(context, train);
+  vector<uint64_t> disk_mistakes =
+      MakeMistakes(context, train, FreezeTree(disk_tree));
+  FLAGS_max_bins = 0;
+
+  EXPECT_LT(5, tree.size());
+  ExpectSameTree(tree, disk_tree);
+  EXPECT_EQ(mistakes, disk_mistakes);
+}
+
+TEST_F(TreeTest, TestTrainTreeByLevel) {
+  context_.tree_depth = 5;
+  // Few distinct values, so that every value is its own bin even when the
+  // number of bins is bounded, and noisy labels. The weights are powers of
+  // two, so that the weights found by subtraction are exact.
+  std::mt19937 rng(13);
+  std::uniform_real_distribution<float> dist;
+  vector<Example> examples(300);
+  for (Example& example : examples) {
+    example.values = {std::round(dist(rng) * 8), std::round(dist(rng) * 8),
+                      std::round(dist(rng) * 8)};
+    example.label =
+        (example.values[0] - example.values[1] + 6 * dist(rng) > 3) ? 1 : -1;
+    example.weight = (dist(rng) < 0.5) ? 1.0 / 256 : 1.0 / 512;
+  }
+  const ExampleSet train = MakeExampleSet(examples);
+  // Without bins, nodes are split one at a time.
+  const FeatureIndex index = MakeFeatureIndex(train);
+  TreeContext context = context_;
+  InitializeTreeContext(train, index, train.weights, &context);
+  context.normalizer = 1;
+  const Tree tree = TrainTree(context, train);
+  // With bins, the tree is grown one level at a time.
+  FLAGS_max_bins = 16;
+  const FeatureIndex level_index = MakeFeatureIndex(train);
+  InitializeTreeContext(train, level_index, train.weights, &context);
+  const Tree level_tree = TrainTree(context, train);
+  FLAGS_max_bins = 0;
+
+  EXPECT_LT(5, tree.size());
+  ExpectSameTree(tree, level_tree);
+}
+
+TEST_F(TreeTest, TestTrainTreeSmallNodes) {
+  context_.tree_depth = 7;
+  // Many distinct values, so that deep nodes have far fewer examples than the
+  // features have values, and only the ranks of their examples are searched.
+  // The weights are powers of two, as in TestTrainTreeByLevel.
+  std::mt19937 rng(17);
+  std::uniform_real_distribution<float> dist;
+  vector<Example> examples(400);
+  for (Example& example : examples) {
+    example.values = {std::round(dist(rng) * 200), std::round(dist(rng) * 200),
+                      std::round(dist(rng) * 2)};
+    example.label =
+        (example.values[0] - example.values[1] + 150 * dist(rng) > 75) ? 1
+                                                                       : -1;
+    example.weight = (dist(rng) < 0.5) ? 1.0 / 256 : 1.0 / 512;
+  }
+  const ExampleSet train = MakeExampleSet(examples);
+  // Without bins, the nodes are searched in parallel batches.
+  const FeatureIndex index = MakeFeatureIndex(train);
+  TreeContext context = context_;
+  InitializeTreeContext(train, index, train.weights, &context);
+  context.normalizer = 1;
+  FLAGS_num_threads = 4;
+  const Tree tree = TrainTree(context, train);
+  FLAGS_num_threads = 1;
+  // Every value is its own bin.
+  FLAGS_max_bins = 256;
+  const FeatureIndex level_index = MakeFeatureIndex(train);
+  InitializeTreeContext(train, level_index, train.weights, &context);
+  const Tree level_tree = TrainTree(context, train);
+  FLAGS_max_bins = 0;
+
+  EXPECT_LT(20, tree.size());
+  ExpectSameTree(tree, level_tree);
+}
+
+TEST_F(TreeTest, TestTrainTreeSparse) {
+  context_.beta = 0;
+  context_.lambda = 0;
+  context_.tree_depth = 4;
+  // Mostly zero values and noisy labels. The weights are powers of two, so
+  // that the weights of the zero values, which are found by subtraction for
+  // the sparse rows, are exact.
+  std::mt19937 rng(11);
+  std::uniform_real_distribution<float> dist;
+  vector<Example> examples(256);
+  for (Example& example : examples) {
+    example.values.assign(5, 0);
+    for (Feature j = 0; j < 5; ++j) {
+      if (dist(rng) < 0.3) {
+        example.values[j] = std::round(dist(rng) * 20) - 5;
+      }
+    }
+    example.label =
+        (example.values[0] - example.values[2] + 8 * dist(rng) > 4) ? 1 : -1;
+    example.weight = (dist(rng) < 0.5) ? 1.0 / 128 : 1.0 / 256;
+  }
+  // Train on every other example, with the non-zero values of the examples
+  // stored in sparse rows.
+  vector<Example> train_examples;
+  for (size_t i = 0; i < examples.size(); i += 2) {
+    train_examples.push_back(examples[i]);
+  }
+  const ExampleSet train = MakeExampleSet(train_examples);
+  ExampleSet sparse_train = train;
+  sparse_train.values.clear();
+  SparseRows& rows = sparse_train.sparse_rows;
+  rows.num_features = 5;
+  rows.offsets.push_back(0);
+  for (const Example& example : train_examples) {
+    for (Feature j = 0; j < rows.num_features; ++j) {
+      if (example.values[j] != 0) {
+        rows.features.push_back(j);
+        rows.values.push_back(example.values[j]);
+      }
+    }
+    rows.offsets.push_back(rows.features.size());
+  }
+  // Sparse training requires bins. With 64 bins, every value is its own bin.
+  for (int max_bins : {4, 64}) {
+    FLAGS_max_bins = max_bins;
+    const FeatureIndex index = MakeFeatureIndex(train);
+    TreeContext context = context_;
+    InitializeTreeContext(train, index, train.weights, &context);
+    context.normalizer = 1;
+    Tree tree = TrainTree(context, train);
+    vector<uint64_t> mistakes = MakeMistakes(context, train, FreezeTree(tree));
+    const FeatureIndex sparse_index = MakeFeatureIndex(sparse_train);
+    InitializeTreeContext(sparse_train, sparse_index, sparse_train.weights,
+                          &context);
+    Tree sparse_tree = TrainTree(context, sparse_train);
+    vector<uint64_t> sparse_mistakes =
+        MakeMistakes(context, sparse_train, FreezeTree(sparse_tree));
+
+    EXPECT_LT(5, tree.size());
+    ExpectSameTree(tree, sparse_tree);
+    EXPECT_EQ(mistakes, sparse_mistakes);
+    for (size_t i = 0; i < train_examples.size(); ++i) {
+      EXPECT_EQ(ClassifyExample(train_examples[i], FreezeTree(tree)),
+                ClassifyExample(sparse_train, i, FreezeTree(tree)));
+    }
+  }
+  FLAGS_max_bins = 0;
+}
+
 TEST_F(TreeTest, TestComplexityPenalty) {
-  FLAGS_beta = 1;
-  FLAGS_lambda = 1;
+  context_.beta = 1;
+  context_.lambda = 1;
 
-  float complexity_penalty = ComplexityPenalty(10);
+  float complexity_penalty = ComplexityPenalty(context_, 10);
   EXPECT_NEAR(2.48087078356, complexity_penalty, kTolerance);
 }
 
+TEST_F(TreeTest, TestComplexityPenaltyTable) {
+  context_.beta = 1;
+  context_.lambda = 1;
+  context_.tree_depth = 2;
+  InitializeTreeContext(example_set_, feature_index_, example_set_.weights,
+                        &context_);
+  // Trees of depth 2 on five examples have at most seven nodes.
+  EXPECT_EQ(8, context_.rademacher.size());
+  // Penalties of sizes in the table are the same as those computed directly.
+  TreeContext untabulated_context = context_;
+  untabulated_context.rademacher.clear();
+  for (int tree_size = 1; tree_size <= 10; ++tree_size) {
+    EXPECT_EQ(ComplexityPenalty(untabulated_context, tree_size),
+              ComplexityPenalty(context_, tree_size));
+  }
+}
+
 TEST_F(TreeTest, GradientTest) {
-  FLAGS_beta = 0;
-  FLAGS_lambda = 0;
+  context_.beta = 0;
+  context_.lambda = 0;
 
-  float gradient = Gradient(0.25, 100, 4, -1);
+  float gradient = Gradient(context_, 0.25, 100, 4, -1);
   EXPECT_NEAR(0.25 - 0.5, gradient, kTolerance);
 
-  FLAGS_beta = 1;
-  FLAGS_lambda = 1;
+  context_.beta = 1;
+  context_.lambda = 1;
 
-  gradient = Gradient(0.25, 10, 1, 1);
-  EXPECT_NEAR(0.25 - 0.5 + ComplexityPenalty(10), gradient, kTolerance);
+  gradient = Gradient(context_, 0.25, 10, 1, 1);
+  EXPECT_NEAR(0.25 - 0.5 + ComplexityPenalty(context_, 10), gradient,
+              kTolerance);
 
-  gradient = Gradient(0.25, 10, -1, 1);
-  EXPECT_NEAR(0.25 - 0.5 - ComplexityPenalty(10), gradient, kTolerance);
+  gradient = Gradient(context_, 0.25, 10, -1, 1);
+  EXPECT_NEAR(0.25 - 0.5 - ComplexityPenalty(context_, 10), gradient,
+              kTolerance);
 
-  gradient = Gradient(0.25, 10, 0, 1);
+  gradient = Gradient(context_, 0.25, 10, 0, 1);
   EXPECT_NEAR(0, gradient, kTolerance);
 
-  FLAGS_beta = 0;
-  FLAGS_lambda = 0.1;
+  context_.beta = 0;
+  context_.lambda = 0.1;
 
-  gradient = Gradient(0.2, 10, 0, 1);
-  EXPECT_NEAR(0.2 - 0.5 - ComplexityPenalty(10), gradient, kTolerance);
+  gradient = Gradient(context_, 0.2, 10, 0, 1);
+  EXPECT_NEAR(0.2 - 0.5 - ComplexityPenalty(context_, 10), gradient,
+              kTolerance);
+
+  gradient = Gradient(context_, 0.2, 10, 0, -1);
+  EXPECT_NEAR(0.2 - 0.5 + ComplexityPenalty(context_, 10), gradient,
+              kTolerance);
+}
 
-  gradient = Gradient(0.2, 10, 0, -1);
-  EXPECT_NEAR(0.2 - 0.5 + ComplexityPenalty(10), gradient, kTolerance);
+TEST_F(TreeTest, TestFreezeTree) {
+  context_.beta = 0;
+  context_.lambda = 0;
+  context_.tree_depth = 2;
+  Tree tree = TrainTree(context_, example_set_);
+  FrozenTree frozen_tree = FreezeTree(tree);
+  EXPECT_EQ(5, frozen_tree.size());
+  // Internal nodes keep their splits
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_FALSE(frozen_tree[i].leaf);
+    EXPECT_EQ(tree[i].split_feature, frozen_tree[i].split_feature);
+    EXPECT_NEAR(tree[i].split_value, frozen_tree[i].split_value, kTolerance);
+    EXPECT_EQ(tree[i].left_child_id, frozen_tree[i].left_child_id);
+    EXPECT_EQ(tree[i].right_child_id, frozen_tree[i].right_child_id);
+  }
+  // Leaves are labeled by majority weight
+  EXPECT_TRUE(frozen_tree[2].leaf);
+  EXPECT_EQ(-1, frozen_tree[2].label);
+  EXPECT_TRUE(frozen_tree[3].leaf);
+  EXPECT_EQ(1, frozen_tree[3].label);
+  EXPECT_TRUE(frozen_tree[4].leaf);
+  EXPECT_EQ(-1, frozen_tree[4].label);
 }
 
 TEST_F(TreeTest, TestClassifyExample) {
-  FLAGS_beta = 0;
-  FLAGS_lambda = 0;
-  FLAGS_tree_depth = 2;
-  Tree tree = TrainTree(examples_);
+  context_.beta = 0;
+  context_.lambda = 0;
+  context_.tree_depth = 2;
+  FrozenTree tree = FreezeTree(TrainTree(context_, example_set_));
 
   EXPECT_EQ(1, ClassifyExample(examples_[0], tree));
   EXPECT_EQ(1, ClassifyExample(examples_[1], tree));
   EXPECT_EQ(1, ClassifyExample(examples_[2], tree));
   EXPECT_EQ(-1, ClassifyExample(examples_[3], tree));
   EXPECT_EQ(-1, ClassifyExample(examples_[4], tree));
+  for (size_t i = 0; i < examples_.size(); ++i) {
+    EXPECT_EQ(ClassifyExample(examples_[i], tree),
+              ClassifyExample(example_set_, i, tree));
+  }
 }
 
 TEST_F(TreeTest, TestEvaluateTreeWgtd) {
-  FLAGS_beta = 0;
-  FLAGS_lambda = 0;
-  FLAGS_tree_depth = 1;
-  Tree tree = TrainTree(examples_);
-  EXPECT_NEAR(0.2, EvaluateTreeWgtd(examples_, tree), kTolerance);
+  context_.beta = 0;
+  context_.lambda = 0;
+  context_.tree_depth = 1;
+  FrozenTree tree = FreezeTree(TrainTree(context_, example_set_));
+  EXPECT_NEAR(0.2, EvaluateTreeWgtd(context_, example_set_, tree), kTolerance);
+}
+
+TEST_F(TreeTest, TestMakeMistakes) {
+  context_.beta = 0;
+  context_.lambda = 0;
+  context_.tree_depth = 1;
+  FrozenTree tree = FreezeTree(TrainTree(context_, example_set_));
+  // The depth 1 tree only gets example 3 wrong.
+  vector<uint64_t> mistakes = MakeMistakes(context_, example_set_, tree);
+  EXPECT_EQ(1, mistakes.size());
+  EXPECT_EQ(static_cast<uint64_t>(1) << 3, mistakes[0]);
+  EXPECT_NEAR(EvaluateTreeWgtd(context_, example_set_, tree),
+              EvaluateMistakesWgtd(context_, mistakes),
+              kTolerance);
+
+  context_.tree_depth = 2;
+  tree = FreezeTree(TrainTree(context_, example_set_));
+  mistakes = MakeMistakes(context_, example_set_, tree);
+  EXPECT_EQ(0, mistakes[0]);
+  EXPECT_NEAR(0.0, EvaluateMistakesWgtd(context_, mistakes),
+              kTolerance);
 }
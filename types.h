@@ -17,6 +17,8 @@ limitations under the License.
 #ifndef TYPES_H_
 #define TYPES_H_
 
+#include <stdint.h>
+
 #include <map>
 #include <vector>
 
@@ -36,16 +38,103 @@ typedef float Weight;
 
 // An example consists of a vector of feature values, a label and a weight.
 // Note that this is a dense feature representation; the value of every
-// feature is contained in the vector, listed in a canonical order.
+// feature is contained in the vector, listed in a canonical order. Examples
+// are parsed one at a time, and are then stored in an ExampleSet.
 typedef struct Example {
   vector<Value> values;
   Label label;
   Weight weight;
 } Example;
 
+// The feature values of a set of examples whose values are mostly zero, in
+// compressed sparse row form. Row i has value values[k] for feature
+// features[k], for k in [offsets[i], offsets[i + 1]), in increasing order of
+// feature, and value zero for every other feature.
+typedef struct SparseRows {
+  int num_features;  // Number of features.
+  vector<int64_t> offsets;  // Start of each row, and end of the last row.
+  vector<Feature> features;  // Features with a stored value.
+  vector<Value> values;  // Stored values.
+} SparseRows;
+
+// A set of examples, stored as a struct of arrays rather than as a vector of
+// Example, so that a pass over one field of every example, like the labels,
+// reads contiguous memory. The i-th example of the set has label labels[i] and
+// initial weight weights[i]. If values is not empty, the value of feature j
+// for the i-th example is values[j * num_examples + i], i.e., each feature is
+// stored in a column. Otherwise, if sparse_rows is not empty, the feature
+// values of the i-th example are in its row i. Otherwise the feature values
+// are stored elsewhere, e.g. on disk.
+typedef struct ExampleSet {
+  int num_examples;  // Number of examples.
+  int num_features;  // Number of features.
+  vector<Label> labels;  // Label of each example.
+  vector<Weight> weights;  // Initial weight of each example.
+  vector<Value> values;  // Feature values, column-major.
+  SparseRows sparse_rows;  // Feature values of a sparse set, row-major.
+} ExampleSet;
+
+// A data set that is read once and split into training, cross-validation and
+// test sets. It is not modified after it is read, so it can be shared by
+// several models trained at the same time.
+typedef struct DataSet {
+  ExampleSet train;  // Training examples.
+  ExampleSet cv;  // Cross-validation examples.
+  ExampleSet test;  // Test examples.
+} DataSet;
+
+// The feature values of a set of examples that are kept on disk, in the
+// columns of a binary data file that is mapped into memory, rather than in the
+// examples themselves. The value of feature j for the i-th example of the set
+// is values[j * num_file_rows + rows[i]].
+typedef struct DiskColumns {
+  const Value* values;  // Columns of all examples in the file.
+  int64_t num_file_rows;  // Number of examples in the file.
+  int num_features;  // Number of features.
+  vector<int64_t> rows;  // Row in the file of each example, increasing.
+} DiskColumns;
+
+// The binned stored values of a set of examples whose feature values are in
+// sparse rows, by feature. The stored values of feature j are those of the
+// examples at positions positions[k] of the set, for k in
+// [offsets[j], offsets[j + 1]), in increasing order of position, and they are
+// in bins ranks[k] of the feature index. The values of all other examples are
+// zero, and are in bin zero_ranks[j], or -1 if there are none.
+typedef struct SparseColumns {
+  vector<int64_t> offsets;
+  vector<int> positions;
+  vector<int> ranks;
+  vector<int> zero_ranks;
+} SparseColumns;
+
+// A presorted, column-major index of the feature values of a set of examples.
+// It is built once per data set and shared by every node of every tree, so
+// that finding the best split value for a feature at a node does not require
+// sorting the node's examples. The values of each feature are grouped into
+// bins, and splits are only considered between bins. Unless the number of bins
+// is limited, every distinct value of a feature is its own bin.
+typedef struct FeatureIndex {
+  // values[feature] contains the largest value in each bin of feature, in
+  // increasing order.
+  vector<vector<Value>> values;
+  // ranks[feature][i] is the position of the bin of the value of feature for
+  // the i-th example of the set in values[feature].
+  vector<vector<int>> ranks;
+  // Ranks of the stored values, if the feature values are in sparse rows. Then
+  // ranks is empty.
+  SparseColumns sparse_columns;
+  // If not null, the columns the feature values are read from, and ranks is
+  // empty.
+  const DiskColumns* disk_columns;
+  // Maximum number of bins of a feature, or 0 if every distinct value of a
+  // feature is its own bin. Set from --max_bins when the index is built.
+  int max_bins;
+} FeatureIndex;
+
 // A tree node.
 typedef struct Node {
-  vector<Example> examples;  // Examples at this node.
+  int rows_begin;  // The examples at this node are the ones whose indices are
+  int rows_end;  // in positions [rows_begin, rows_end) of the tree's rows.
   Feature split_feature;  // Split feature.
   Value split_value;  // Split value.
   NodeId left_child_id;  // Pointer to left child, if any.
@@ -59,8 +148,23 @@ typedef struct Node {
 // A tree is a vector of nodes.
 typedef vector<Node> Tree;
 
+// A node of a trained tree. Unlike Node, it only holds what is needed to
+// classify examples.
+typedef struct FrozenNode {
+  Feature split_feature;  // Split feature.
+  Value split_value;  // Split value.
+  NodeId left_child_id;  // Pointer to left child, if any.
+  NodeId right_child_id;  // Pointer to right child, if any.
+  Label label;  // Label of examples that reach this node, if it is a leaf.
+  bool leaf;  // Is this node a leaf?
+} FrozenNode;
+
+// A frozen tree is a vector of frozen nodes. Its nodes have the same ids as the
+// nodes of the tree it was frozen from.
+typedef vector<FrozenNode> FrozenTree;
+
 // A model is a vector of (weight, tree) pairs, i.e., a weighted combination of
 // trees.
-typedef vector<pair<Weight, Tree>> Model;
+typedef vector<pair<Weight, FrozenTree>> Model;
 
 #endif  // TYPES_H_